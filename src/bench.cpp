@@ -0,0 +1,541 @@
+// realesrgan implemented with ncnn library
+// realesrgan-bench, times RealESRGAN on synthetic frames without VapourSynth
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// ncnn
+#include <cpu.h>
+#include <gpu.h>
+#include <platform.h>
+
+#include "gpuscheduler.h"
+#include "realesrgan.h"
+
+struct BenchFormat
+{
+  const char *name;
+  int bits;
+  bool float_sample;
+  bool yuv;
+  int ssw;
+  int ssh;
+};
+
+static const BenchFormat formats[] = {
+    {"RGB24", 8, false, false, 0, 0},
+    {"RGB48", 16, false, false, 0, 0},
+    {"RGBH", 16, true, false, 0, 0},
+    {"RGBS", 32, true, false, 0, 0},
+    {"YUV420P8", 8, false, true, 1, 1},
+    {"YUV420P10", 10, false, true, 1, 1},
+    {"YUV444PS", 32, true, true, 0, 0},
+};
+
+static void usage()
+{
+  std::fprintf(stderr,
+               "Usage: realesrgan-bench -m models-dir [options]\n"
+               "  -m dir        directory holding the realesr*.param/.bin models\n"
+               "  -g gpu-id     Vulkan device, -1 for the CPU backend (default 0)\n"
+               "  -f format     RGB24, RGB48, RGBH, RGBS, YUV420P8, YUV420P10 or YUV444PS (default RGBS)\n"
+               "  -r sizes      comma separated WxH frame sizes (default 640x360)\n"
+               "  -n models     comma separated model ids, as the filter's model (default 0)\n"
+               "  -s scales     comma separated scales (default 2)\n"
+               "  -t tilesizes  comma separated tile sizes (default 100)\n"
+               "  -x tta        comma separated tta modes (default 0)\n"
+               "  -p precisions comma separated network precisions, as the filter's precision, -1 for the device default,\n"
+               "                each reported with its error against fp32, 3 (int8) needs -g -1 (default -1)\n"
+               "  -j threads    comma separated numbers of frames processed concurrently (default 1)\n"
+               "  -c count      timed frames per case (default 10)\n"
+               "  -o file       write the results as JSON to file, - for stdout\n");
+}
+
+static std::vector<int> parse_list(const char *arg)
+{
+  std::vector<int> values;
+  for (const char *p = arg; *p;)
+  {
+    char *end;
+    values.push_back((int)std::strtol(p, &end, 10));
+    p = *end == ',' ? end + 1 : end + std::strlen(end);
+  }
+  return values;
+}
+
+static std::vector<std::pair<int, int>> parse_sizes(const char *arg)
+{
+  std::vector<std::pair<int, int>> sizes;
+  for (const char *p = arg; *p;)
+  {
+    char *end;
+    int w = (int)std::strtol(p, &end, 10);
+    int h = *end == 'x' ? (int)std::strtol(end + 1, &end, 10) : 0;
+    if (w > 0 && h > 0)
+      sizes.emplace_back(w, h);
+    p = *end == ',' ? end + 1 : end + std::strlen(end);
+  }
+  return sizes;
+}
+
+// peak resident memory of the process
+static double peak_rss_mb()
+{
+#if _WIN32
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+    return pmc.PeakWorkingSetSize / 1048576.0;
+  return 0;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#if __APPLE__
+  return usage.ru_maxrss / 1048576.0;
+#else
+  return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+// device local memory used by the process, from VK_EXT_memory_budget, 0 where unsupported
+static double device_memory_mb(int gpuid)
+{
+  if (gpuid < 0 || !ncnn::get_gpu_info(gpuid).support_VK_EXT_memory_budget())
+    return 0;
+
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget{};
+  budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+  VkPhysicalDeviceMemoryProperties2 properties{};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+  properties.pNext = &budget;
+
+  vkGetPhysicalDeviceMemoryProperties2(ncnn::get_gpu_info(gpuid).physical_device(), &properties);
+
+  double usage = 0;
+  for (uint32_t i = 0; i < properties.memoryProperties.memoryHeapCount; i++)
+  {
+    if (properties.memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+      usage += budget.heapUsage[i] / 1048576.0;
+  }
+  return usage;
+}
+
+// frame planes filled with noise in the sample range, so no stage can shortcut on flat content
+struct BenchFrame
+{
+  std::vector<std::vector<uint8_t>> planes;
+  int stride[3];
+
+  BenchFrame(const BenchFormat &format, int width, int height, bool fill)
+  {
+    const int bytes = format.bits == 8 ? 1 : format.bits <= 16 ? 2 : 4;
+    std::mt19937 rng(width * 31 + height);
+    std::uniform_real_distribution<float> dist(0.f, 1.f);
+
+    planes.resize(3);
+    for (int c = 0; c < 3; c++)
+    {
+      const int w = c > 0 && format.yuv ? width >> format.ssw : width;
+      const int h = c > 0 && format.yuv ? height >> format.ssh : height;
+      stride[c] = w * bytes;
+      planes[c].resize((size_t)stride[c] * h);
+
+      if (!fill)
+        continue;
+
+      const float offset = c > 0 && format.yuv && format.float_sample ? -0.5f : 0.f;
+      for (size_t i = 0; i < planes[c].size() / bytes; i++)
+      {
+        const float v = dist(rng);
+        if (format.float_sample && bytes == 4)
+          ((float *)planes[c].data())[i] = v + offset;
+        else if (format.float_sample)
+          ((unsigned short *)planes[c].data())[i] = ncnn::float32_to_float16(v + offset);
+        else if (bytes == 1)
+          planes[c][i] = (uint8_t)(v * 255.f);
+        else
+          ((uint16_t *)planes[c].data())[i] = (uint16_t)(v * (float)((1 << format.bits) - 1));
+      }
+    }
+  }
+};
+
+// quoted json string
+static std::string json_string(const std::string &value)
+{
+  std::string quoted = "\"";
+  for (char ch : value)
+  {
+    if (ch == '"' || ch == '\\')
+      quoted += std::format("\\{}", ch);
+    else if ((unsigned char)ch < 0x20)
+      quoted += std::format("\\u{:04x}", (int)ch);
+    else
+      quoted += ch;
+  }
+  return quoted + "\"";
+}
+
+// normalized sample i of a plane
+static double load_sample(const BenchFormat &format, const std::vector<uint8_t> &plane, size_t i)
+{
+  if (format.float_sample && format.bits == 32)
+    return ((const float *)plane.data())[i];
+  if (format.float_sample)
+    return ncnn::float16_to_float32(((const unsigned short *)plane.data())[i]);
+  if (format.bits == 8)
+    return plane[i] / 255.0;
+  return ((const uint16_t *)plane.data())[i] / (double)((1 << format.bits) - 1);
+}
+
+// psnr in dB, 0 for identical frames, and largest absolute difference of normalized samples
+static void frame_error(const BenchFormat &format, const BenchFrame &a, const BenchFrame &b, double &psnr, double &max_error)
+{
+  const int bytes = format.bits == 8 ? 1 : format.bits <= 16 ? 2 : 4;
+
+  double sum = 0;
+  size_t n = 0;
+  max_error = 0;
+  for (int c = 0; c < 3; c++)
+  {
+    for (size_t i = 0; i < a.planes[c].size() / bytes; i++)
+    {
+      const double e = load_sample(format, a.planes[c], i) - load_sample(format, b.planes[c], i);
+      sum += e * e;
+      max_error = std::max(max_error, std::abs(e));
+      n++;
+    }
+  }
+
+  psnr = sum > 0 ? 10 * std::log10(n / sum) : 0;
+}
+
+int main(int argc, char **argv)
+{
+  std::string modelDir;
+  int gpuId = 0;
+  const BenchFormat *format = &formats[3];
+  std::vector<std::pair<int, int>> sizes{{640, 360}};
+  std::vector<int> models{0}, scales{2}, tilesizes{100}, ttas{0}, threads{1}, precisions{-1};
+  int count = 10;
+  std::string jsonPath;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *opt = argv[i];
+    const char *arg = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (opt[0] != '-' || !opt[1] || opt[2] || !arg)
+    {
+      usage();
+      return 1;
+    }
+    i++;
+
+    switch (opt[1])
+    {
+    case 'm':
+      modelDir = arg;
+      break;
+    case 'g':
+      gpuId = std::atoi(arg);
+      break;
+    case 'f':
+      format = nullptr;
+      for (const BenchFormat &f : formats)
+      {
+        if (std::strcmp(f.name, arg) == 0)
+          format = &f;
+      }
+      if (!format)
+      {
+        std::fprintf(stderr, "unknown format %s\n", arg);
+        return 1;
+      }
+      break;
+    case 'r':
+      sizes = parse_sizes(arg);
+      break;
+    case 'n':
+      models = parse_list(arg);
+      break;
+    case 's':
+      scales = parse_list(arg);
+      break;
+    case 't':
+      tilesizes = parse_list(arg);
+      break;
+    case 'x':
+      ttas = parse_list(arg);
+      break;
+    case 'j':
+      threads = parse_list(arg);
+      break;
+    case 'p':
+      precisions = parse_list(arg);
+      break;
+    case 'c':
+      count = std::max(std::atoi(arg), 1);
+      break;
+    case 'o':
+      jsonPath = arg;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (modelDir.empty())
+  {
+    usage();
+    return 1;
+  }
+
+  // as in the filter, ncnn has no int8 GPU layers
+  if (gpuId >= 0 && std::find(precisions.begin(), precisions.end(), 3) != precisions.end())
+  {
+    std::fprintf(stderr, "int8 precision is only supported on the CPU, -g -1\n");
+    return 1;
+  }
+
+  ncnn::create_gpu_instance();
+  if (gpuId < -1 || gpuId >= ncnn::get_gpu_count())
+  {
+    std::fprintf(stderr, "invalid gpu id %d\n", gpuId);
+    ncnn::destroy_gpu_instance();
+    return 1;
+  }
+
+  const std::string device = gpuId >= 0 ? ncnn::get_gpu_info(gpuId).device_name() : std::format("cpu, {} threads", ncnn::get_big_cpu_count());
+  std::fprintf(stderr, "device: %s\n", device.c_str());
+
+  std::string json = std::format("{{\"device\":{},\"format\":{},\"results\":[", json_string(device), json_string(format->name));
+  bool firstResult = true;
+  // any model that fails to load or case that fails to process makes the exit status non-zero
+  bool anyFailed = false;
+
+  for (int model : models)
+  {
+    for (int scale : scales)
+    {
+      std::string param, bin;
+      if (model == 0)
+      {
+        param = std::format("{}/realesr-animevideov3-x{}.param", modelDir, scale);
+        bin = std::format("{}/realesr-animevideov3-x{}.bin", modelDir, scale);
+      }
+      else if ((model == 1 || model == 2) && scale == 4)
+      {
+        const char *name = model == 1 ? "realesrgan-x4plus-anime" : "realesrgan-x4plus";
+        param = std::format("{}/{}.param", modelDir, name);
+        bin = std::format("{}/{}.bin", modelDir, name);
+      }
+      else
+      {
+        std::fprintf(stderr, "skipping model %d at scale %d\n", model, scale);
+        continue;
+      }
+
+      // fp32 references, by tta
+      std::shared_ptr<RealESRGANModel> referenceModels[2];
+
+      std::vector<std::pair<int, int>> variants;
+      for (int tta : ttas)
+      {
+        for (int precision : precisions)
+          variants.emplace_back(tta, precision);
+      }
+
+      for (const auto &[tta, precision] : variants)
+      {
+        auto realesrganModel = std::make_shared<RealESRGANModel>(gpuId, tta != 0);
+        if (gpuId < 0)
+          realesrganModel->net.opt.num_threads = ncnn::get_big_cpu_count();
+        if (precision >= 0)
+          realesrganModel->set_precision(precision);
+
+        const auto loadStart = std::chrono::steady_clock::now();
+        if (realesrganModel->load(param, bin) != 0)
+        {
+          std::fprintf(stderr, "can't load %s\n", param.c_str());
+          anyFailed = true;
+          continue;
+        }
+        const double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+
+        for (const auto &[width, height] : sizes)
+        {
+          BenchFrame src(*format, width, height, true);
+
+          for (int tilesize : tilesizes)
+          {
+            for (int nthreads : threads)
+            {
+              nthreads = std::max(nthreads, 1);
+
+              std::unique_ptr<GpuScheduler> scheduler;
+              if (gpuId >= 0)
+              {
+                const ncnn::GpuInfo &info = ncnn::get_gpu_info(gpuId);
+                scheduler = std::make_unique<GpuScheduler>((int)std::min(info.transfer_queue_count(), info.compute_queue_count()), nthreads);
+              }
+
+              auto configure = [&](RealESRGAN &realesrgan) {
+                realesrgan.scale = scale;
+                realesrgan.tilesize = tilesize;
+                realesrgan.tilesize_y = tilesize;
+                realesrgan.prepadding = 10;
+                realesrgan.bits_per_sample = format->bits;
+                realesrgan.float_sample = format->float_sample;
+                realesrgan.yuv = format->yuv;
+                realesrgan.chroma_ssw = format->ssw;
+                realesrgan.chroma_ssh = format->ssh;
+                realesrgan.scheduler = scheduler.get();
+              };
+
+              RealESRGAN realesrgan(realesrganModel);
+              configure(realesrgan);
+
+              std::vector<BenchFrame> dst;
+              for (int t = 0; t < nthreads; t++)
+                dst.emplace_back(*format, width * scale, height * scale, false);
+
+              auto run = [&](int t, RealESRGANStageTimes *stageTimes) {
+                const uint8_t *srcp[3] = {src.planes[0].data(), src.planes[1].data(), src.planes[2].data()};
+                uint8_t *dstp[3] = {dst[t].planes[0].data(), dst[t].planes[1].data(), dst[t].planes[2].data()};
+                return realesrgan.process(srcp, dstp, width, height, src.stride, dst[t].stride, stageTimes);
+              };
+
+              // warm-up allocates the pools and tile buffers
+              int ret = run(0, nullptr);
+
+              // throughput, frames shared between the threads
+              std::atomic<int> next{0};
+              std::atomic<int> failed{ret};
+              const auto start = std::chrono::steady_clock::now();
+              {
+                std::vector<std::thread> workers;
+                for (int t = 0; t < nthreads; t++)
+                {
+                  workers.emplace_back([&, t]() {
+                    while (next++ < count)
+                    {
+                      if (run(t, nullptr) != 0)
+                        failed = 1;
+                    }
+                  });
+                }
+                for (std::thread &worker : workers)
+                  worker.join();
+              }
+              const double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+              const double deviceMb = device_memory_mb(gpuId);
+
+              // stage breakdown, one frame at a time
+              RealESRGANStageTimes stageTimes;
+              for (int i = 0; i < count; i++)
+              {
+                if (run(0, &stageTimes) != 0)
+                  failed = 1;
+              }
+
+              // error of the last frame against the fp32 reference model
+              double psnr = 0, maxError = 0;
+              if (precision != 0)
+              {
+                std::shared_ptr<RealESRGANModel> &reference = referenceModels[tta != 0];
+                if (!reference)
+                {
+                  reference = std::make_shared<RealESRGANModel>(gpuId, tta != 0);
+                  if (gpuId < 0)
+                    reference->net.opt.num_threads = ncnn::get_big_cpu_count();
+                  reference->set_precision(0);
+                  if (reference->load(param, bin) != 0)
+                    reference.reset();
+                }
+
+                if (reference)
+                {
+                  RealESRGAN fp32(reference);
+                  configure(fp32);
+
+                  BenchFrame referenceDst(*format, width * scale, height * scale, false);
+                  const uint8_t *srcp[3] = {src.planes[0].data(), src.planes[1].data(), src.planes[2].data()};
+                  uint8_t *dstp[3] = {referenceDst.planes[0].data(), referenceDst.planes[1].data(), referenceDst.planes[2].data()};
+                  if (fp32.process(srcp, dstp, width, height, src.stride, referenceDst.stride) == 0)
+                    frame_error(*format, dst[0], referenceDst, psnr, maxError);
+                }
+              }
+
+              const double fps = count * 1000.0 / totalMs;
+              std::fprintf(stderr, "%dx%d model %d x%d tile %d tta %d precision %d threads %d: %.2f fps, %.1f ms/frame%s\n", width, height, model,
+                           scale, tilesize, tta, precision, nthreads, fps, totalMs / count, failed ? " (failed)" : "");
+              if (precision != 0)
+                std::fprintf(stderr, "  error against fp32: psnr %.2f dB, max %.5f\n", psnr, maxError);
+
+              std::string stages;
+              for (int s = 0; s < RealESRGANStageTimes::StageCount; s++)
+              {
+                const char *name = RealESRGANStageTimes::name((RealESRGANStageTimes::Stage)s);
+                std::fprintf(stderr, "  %-10s %8.2f ms/frame\n", name, stageTimes.ms[s] / count);
+                stages += std::format("{}\"{}\":{:.3f}", s ? "," : "", name, stageTimes.ms[s] / count);
+              }
+
+              json += std::format("{}{{\"width\":{},\"height\":{},\"model\":{},\"scale\":{},\"tilesize\":{},\"tta\":{},\"precision\":{},"
+                                  "\"threads\":{},\"frames\":{},\"ok\":{},\"load_ms\":{:.1f},\"fps\":{:.3f},\"ms_per_frame\":{:.3f},"
+                                  "\"stage_ms_per_frame\":{{{}}},\"peak_rss_mb\":{:.1f},\"device_mb\":{:.1f},\"psnr_db\":{:.3f},"
+                                  "\"max_error\":{:.6f}}}",
+                                  firstResult ? "" : ",", width, height, model, scale, tilesize, tta, precision, nthreads, count,
+                                  failed ? "false" : "true", loadMs, fps, totalMs / count, stages, peak_rss_mb(), deviceMb, psnr,
+                                  maxError);
+              firstResult = false;
+              anyFailed |= failed != 0;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  json += "]}\n";
+
+  if (jsonPath == "-")
+  {
+    std::cout << json;
+  }
+  else if (!jsonPath.empty())
+  {
+    std::ofstream f(jsonPath);
+    f << json;
+    if (!f)
+    {
+      std::fprintf(stderr, "can't write %s\n", jsonPath.c_str());
+      anyFailed = true;
+    }
+  }
+
+  ncnn::destroy_gpu_instance();
+
+  return anyFailed ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+// realesrgan implemented with ncnn library
+
+#include "gpuscheduler.h"
+
+#include <algorithm>
+
+GpuScheduler::GpuScheduler(int threads, int _capacity)
+{
+    capacity = (size_t)std::max(_capacity, 1);
+    stopping = false;
+
+    for (int i = 0; i < std::max(threads, 1); i++)
+        workers.emplace_back(&GpuScheduler::run, this);
+}
+
+GpuScheduler::~GpuScheduler()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    not_empty.notify_all();
+
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+std::future<int> GpuScheduler::submit(std::function<int()> job)
+{
+    std::packaged_task<int()> task(std::move(job));
+    std::future<int> result = task.get_future();
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_full.wait(guard, [this] { return jobs.size() < capacity; });
+        jobs.push_back(std::move(task));
+    }
+    not_empty.notify_one();
+
+    return result;
+}
+
+void GpuScheduler::run()
+{
+    for (;;)
+    {
+        std::packaged_task<int()> task;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            not_empty.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+
+            task = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        not_full.notify_one();
+
+        task();
+    }
+}
@@ -0,0 +1,40 @@
+// realesrgan implemented with ncnn library
+
+#ifndef GPUSCHEDULER_H
+#define GPUSCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs the gpu work of tile rows on dedicated submission threads, one per device queue used.
+// Callers pack and unpack tile rows on their own thread and only block when the job queue is full.
+class GpuScheduler
+{
+public:
+  GpuScheduler(int threads, int capacity);
+  ~GpuScheduler();
+
+  std::future<int> submit(std::function<int()> job);
+
+  int threads() const { return (int)workers.size(); }
+  int queue_capacity() const { return (int)capacity; }
+
+private:
+  void run();
+
+private:
+  std::mutex lock;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<std::packaged_task<int()>> jobs;
+  size_t capacity;
+  bool stopping;
+  std::vector<std::thread> workers;
+};
+
+#endif // GPUSCHEDULER_H
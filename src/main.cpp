@@ -7,9 +7,18 @@
 #include <clocale>
 #include <filesystem>
 #include <mutex>
-#include <condition_variable>
 #include <map>
 #include <fstream>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
 
 // ncnn
 #include <VSHelper.h>
@@ -18,36 +27,56 @@
 #include <gpu.h>
 #include <platform.h>
 
+#include "gpuscheduler.h"
 #include "realesrgan.h"
 
 namespace fs = std::filesystem;
 
-class Semaphore
+// One device of a filter instance
+struct FilterGpu
 {
-private:
-  int val;
-  std::mutex mtx;
-  std::condition_variable cv;
-
-public:
-  explicit Semaphore(int init_value) : val(init_value) {}
+  std::unique_ptr<RealESRGAN> realesrgan;
+  GpuScheduler *scheduler;
+  int threads;
+  // frames dispatched and not finished yet, and the running average of the processing time
+  int queued;
+  double frame_ms;
+};
 
-  void wait()
-  {
-    std::unique_lock<std::mutex> lock(mtx);
-    while (val <= 0)
-    {
-      cv.wait(lock);
-    }
-    val--;
-  }
+// Upscaled frames by content hash of their source frame, within a memory budget
+struct FrameCache
+{
+  std::mutex lock;
+  size_t budget;
+  size_t size;
+  // most recently used first
+  std::list<std::pair<uint64_t, const VSFrameRef *>> frames;
+  std::unordered_map<uint64_t, std::list<std::pair<uint64_t, const VSFrameRef *>>::iterator> index;
+  std::atomic<int> hits;
+  std::atomic<int> misses;
+};
 
-  void signal()
-  {
-    std::lock_guard<std::mutex> guard(mtx);
-    val++;
-    cv.notify_one();
-  }
+// Device and model options, kept to set the devices up when the filter is created or, lazily, on the first frame
+struct FilterOptions
+{
+  std::string paramPath;
+  std::string modelPath;
+  std::vector<int> gpuIds;
+  int customTilesize, customTilesizeY;
+  int tileMode;
+  int customGpuThread;
+  bool tta;
+  int pipelineDepth;
+  bool autotune;
+  float skipThreshold;
+  bool halfDownload;
+  int maxVramMb;
+  int cpuThreads;
+  bool cpuPacking;
+  int cpuHalf;
+  int precision;
+  int matrix;
+  bool fullRange;
 };
 
 struct FilterData
@@ -55,13 +84,27 @@ struct FilterData
   VSNodeRef *node;
   const VSVideoInfo *vi;
   int target_width, target_height;
-  RealESRGAN *realesrgan;
-  Semaphore *gpuSemaphore;
+  std::vector<FilterGpu> gpus;
+  std::mutex dispatchLock;
+  // per stage timing attached to every frame and summed up for the log at free
+  bool timing;
+  RealESRGANStageTimes totalTimes;
+  std::atomic<int> timedFrames;
+  // duplicate and re-requested frames are copied from here, disabled with a zero budget
+  FrameCache frameCache;
+  // with lazy, devices are set up by the first frame request, initError holds why that failed
+  FilterOptions options;
+  bool lazy;
+  std::once_flag initOnce;
+  std::string initError;
 };
 
 static std::mutex g_lock{};
 static int g_filter_instance_count = 0;
-static std::map<int, Semaphore *> g_gpu_semaphore;
+static bool g_gpu_instance = false;
+static std::map<int, GpuScheduler *> g_gpu_scheduler;
+// loaded models by gpu id, model files, fp16 options and tta, shared between filter instances
+static std::map<std::string, std::shared_ptr<const RealESRGANModel>> g_models;
 
 static void VS_CC filterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi)
 {
@@ -72,32 +115,170 @@ static void VS_CC filterInit(VSMap *in, VSMap *out, void **instanceData, VSNode
   vsapi->setVideoInfo(&dst_vi, 1, node);
 }
 
-static void process(const VSFrameRef *src, VSFrameRef *dst, const FilterData *const VS_RESTRICT d, const VSAPI *vsapi) noexcept
+// Frames go to the device expected to finish them first, from its queued frames and measured frame time
+static FilterGpu &acquireGpu(FilterData *d)
+{
+  std::lock_guard<std::mutex> guard(d->dispatchLock);
+
+  // devices without a measurement yet are assumed as fast as the fastest measured one
+  double fallback_ms = 0;
+  for (const FilterGpu &gpu : d->gpus)
+  {
+    if (gpu.frame_ms > 0 && (fallback_ms == 0 || gpu.frame_ms < fallback_ms))
+      fallback_ms = gpu.frame_ms;
+  }
+  if (fallback_ms == 0)
+    fallback_ms = 1;
+
+  FilterGpu *best = nullptr;
+  double best_finish = 0;
+  for (FilterGpu &gpu : d->gpus)
+  {
+    const double finish = (gpu.frame_ms > 0 ? gpu.frame_ms : fallback_ms) * (gpu.queued / gpu.threads + 1);
+    if (!best || finish < best_finish)
+    {
+      best = &gpu;
+      best_finish = finish;
+    }
+  }
+
+  best->queued++;
+  return *best;
+}
+
+static void releaseGpu(FilterData *d, FilterGpu &gpu, double ms)
+{
+  std::lock_guard<std::mutex> guard(d->dispatchLock);
+  gpu.queued--;
+  gpu.frame_ms = gpu.frame_ms > 0 ? gpu.frame_ms * 0.9 + ms * 0.1 : ms;
+}
+
+// 64 bit hash of every plane, rows without their stride padding
+static uint64_t hashFrame(const VSFrameRef *frame, const VSFormat *format, const VSAPI *vsapi)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ull;
+  for (int plane = 0; plane < format->numPlanes; plane++)
+  {
+    const uint8_t *row = vsapi->getReadPtr(frame, plane);
+    const int stride = vsapi->getStride(frame, plane);
+    const int height = vsapi->getFrameHeight(frame, plane);
+    const size_t rowSize = static_cast<size_t>(vsapi->getFrameWidth(frame, plane)) * format->bytesPerSample;
+
+    for (int y = 0; y < height; y++, row += stride)
+    {
+      size_t x = 0;
+      for (; x + 8 <= rowSize; x += 8)
+      {
+        uint64_t v;
+        std::memcpy(&v, row + x, 8);
+        h = (h ^ v) * 0x9fb21c651e98df25ull;
+        h = (h << 31) | (h >> 33);
+      }
+      for (; x < rowSize; x++)
+        h = (h ^ row[x]) * 0x9fb21c651e98df25ull;
+    }
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Copies a cached frame into dst, returns false on a miss
+static bool lookupFrame(FrameCache &cache, uint64_t hash, VSFrameRef *dst, const VSFormat *format, const VSAPI *vsapi)
+{
+  const VSFrameRef *frame;
+  {
+    std::lock_guard<std::mutex> guard(cache.lock);
+    auto it = cache.index.find(hash);
+    if (it == cache.index.end())
+    {
+      cache.misses++;
+      return false;
+    }
+    cache.frames.splice(cache.frames.begin(), cache.frames, it->second);
+    frame = vsapi->cloneFrameRef(it->second->second);
+  }
+
+  for (int plane = 0; plane < format->numPlanes; plane++)
+    vs_bitblt(vsapi->getWritePtr(dst, plane), vsapi->getStride(dst, plane), vsapi->getReadPtr(frame, plane),
+              vsapi->getStride(frame, plane), static_cast<size_t>(vsapi->getFrameWidth(frame, plane)) * format->bytesPerSample,
+              vsapi->getFrameHeight(frame, plane));
+
+  vsapi->freeFrame(frame);
+  cache.hits++;
+  return true;
+}
+
+// Keeps a reference to an upscaled frame, evicting the least recently used ones over the budget
+static void storeFrame(FrameCache &cache, uint64_t hash, const VSFrameRef *frame, const VSFormat *format, const VSAPI *vsapi)
+{
+  size_t frameSize = 0;
+  for (int plane = 0; plane < format->numPlanes; plane++)
+    frameSize += static_cast<size_t>(vsapi->getStride(frame, plane)) * vsapi->getFrameHeight(frame, plane);
+
+  std::lock_guard<std::mutex> guard(cache.lock);
+  if (frameSize > cache.budget || cache.index.count(hash))
+    return;
+
+  cache.frames.emplace_front(hash, vsapi->cloneFrameRef(frame));
+  cache.index[hash] = cache.frames.begin();
+  cache.size += frameSize;
+
+  while (cache.size > cache.budget)
+  {
+    const VSFrameRef *evicted = cache.frames.back().second;
+    size_t evictedSize = 0;
+    for (int plane = 0; plane < format->numPlanes; plane++)
+      evictedSize += static_cast<size_t>(vsapi->getStride(evicted, plane)) * vsapi->getFrameHeight(evicted, plane);
+
+    cache.index.erase(cache.frames.back().first);
+    cache.frames.pop_back();
+    cache.size -= evictedSize;
+    vsapi->freeFrame(evicted);
+  }
+}
+
+// Upscales one frame on the device expected to finish it first, returns the ncnn error code
+static int process(const VSFrameRef *src, VSFrameRef *dst, FilterData *const VS_RESTRICT d, const VSAPI *vsapi,
+                   RealESRGANStageTimes *stageTimes) noexcept
 {
-  if (d->vi->format->colorFamily == cmRGB)
+  if (d->vi->format->colorFamily == cmRGB || d->vi->format->colorFamily == cmYUV)
   {
     int src_width = vsapi->getFrameWidth(src, 0);
     int src_height = vsapi->getFrameHeight(src, 0);
-    int src_stride = vsapi->getStride(src, 0) / sizeof(float);
-    int dst_stride = vsapi->getStride(dst, 0) / sizeof(float);
+    const int src_stride[3] = {vsapi->getStride(src, 0), vsapi->getStride(src, 1), vsapi->getStride(src, 2)};
+    const int dst_stride[3] = {vsapi->getStride(dst, 0), vsapi->getStride(dst, 1), vsapi->getStride(dst, 2)};
 
-    const float *srcpR = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0));
-    const float *srcpG = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1));
-    const float *srcpB = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2));
+    const uint8_t *srcp[3] = {vsapi->getReadPtr(src, 0), vsapi->getReadPtr(src, 1), vsapi->getReadPtr(src, 2)};
+    uint8_t *dstp[3] = {vsapi->getWritePtr(dst, 0), vsapi->getWritePtr(dst, 1), vsapi->getWritePtr(dst, 2)};
 
-    float *VS_RESTRICT dstpR = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0));
-    float *VS_RESTRICT dstpG = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1));
-    float *VS_RESTRICT dstpB = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2));
+    FilterGpu &gpu = acquireGpu(d);
+    const auto start = std::chrono::steady_clock::now();
+    bool shrunk = false;
+    const int ret = gpu.realesrgan->process(srcp, dstp, src_width, src_height, src_stride, dst_stride, stageTimes, &shrunk);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    releaseGpu(d, gpu, ms);
 
-    d->gpuSemaphore->wait();
-    d->realesrgan->process(srcpR, srcpG, srcpB, dstpR, dstpG, dstpB, src_width, src_height, src_stride, dst_stride);
-    d->gpuSemaphore->signal();
+    // Smaller tiles are kept for later frames, reported once by the frame that ran out of memory
+    if (shrunk)
+    {
+      int tileX, tileY;
+      gpu.realesrgan->tile_size(src_width, src_height, tileX, tileY);
+      vsapi->logMessage(mtWarning, std::format("RealESRGAN: out of device memory, continuing with {}x{} tiles", tileX, tileY).c_str());
+    }
+    return ret;
   }
+
+  return 0;
 }
 
+static void initGpus(FilterData *d, const VSAPI *vsapi);
+
 static const VSFrameRef *VS_CC filterGetFrame(int n, int activationReason, void **instancData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
 {
-  const FilterData *d = static_cast<const FilterData *>(*instancData);
+  FilterData *d = static_cast<FilterData *>(*instancData);
 
   if (activationReason == arInitial)
   {
@@ -105,10 +286,70 @@ static const VSFrameRef *VS_CC filterGetFrame(int n, int activationReason, void
   }
   else if (activationReason == arAllFramesReady)
   {
+    // Lazy setup, concurrent first requests wait for the one running it
+    if (d->lazy)
+    {
+      std::call_once(d->initOnce, [d, vsapi]() {
+        try
+        {
+          initGpus(d, vsapi);
+        }
+        catch (const std::string &error)
+        {
+          d->gpus.clear();
+          d->initError = error;
+        }
+      });
+      if (!d->initError.empty())
+      {
+        vsapi->setFilterError(("RealESRGAN: " + d->initError).c_str(), frameCtx);
+        return nullptr;
+      }
+    }
+
     const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
     VSFrameRef *dst = vsapi->newVideoFrame(d->vi->format, d->target_width, d->target_height, src, core);
 
-    process(src, dst, d, vsapi);
+    // Duplicate frames cost a hash and a copy
+    uint64_t hash = 0;
+    bool cached = false;
+    if (d->frameCache.budget > 0)
+    {
+      hash = hashFrame(src, d->vi->format, vsapi);
+      cached = lookupFrame(d->frameCache, hash, dst, d->vi->format, vsapi);
+      vsapi->propSetInt(vsapi->getFramePropsRW(dst), "_ESRGANCacheHit", cached ? 1 : 0, paReplace);
+    }
+
+    RealESRGANStageTimes stageTimes;
+    if (!cached)
+    {
+      const int ret = process(src, dst, d, vsapi, d->timing ? &stageTimes : nullptr);
+      if (ret != 0)
+      {
+        vsapi->freeFrame(src);
+        vsapi->freeFrame(dst);
+        vsapi->setFilterError(ret == -100 ? "RealESRGAN: out of memory, even with the smallest tiles"
+                                          : std::format("RealESRGAN: processing failed with error {}", ret).c_str(),
+                              frameCtx);
+        return nullptr;
+      }
+    }
+
+    if (d->timing)
+    {
+      VSMap *props = vsapi->getFramePropsRW(dst);
+      for (int s = 0; s < RealESRGANStageTimes::StageCount; s++)
+      {
+        std::string name = RealESRGANStageTimes::name(static_cast<RealESRGANStageTimes::Stage>(s));
+        name[0] = static_cast<char>(std::toupper(name[0]));
+        vsapi->propSetFloat(props, ("_ESRGANTime" + name).c_str(), stageTimes.ms[s], paReplace);
+        d->totalTimes.add(static_cast<RealESRGANStageTimes::Stage>(s), stageTimes.ms[s]);
+      }
+      d->timedFrames++;
+    }
+
+    if (d->frameCache.budget > 0 && !cached)
+      storeFrame(d->frameCache, hash, dst, d->vi->format, vsapi);
 
     vsapi->freeFrame(src);
     return dst;
@@ -117,24 +358,359 @@ static const VSFrameRef *VS_CC filterGetFrame(int n, int activationReason, void
   return nullptr;
 }
 
+// Drops a filter instance whose devices are already freed, the last one also frees the models, the schedulers and the
+// GPU instance
+static void releaseInstance()
+{
+  std::lock_guard<std::mutex> guard(g_lock);
+  g_filter_instance_count--;
+  if (g_filter_instance_count == 0)
+  {
+    g_models.clear();
+    for (auto pair : g_gpu_scheduler)
+    {
+      delete pair.second;
+    }
+    g_gpu_scheduler.clear();
+    if (g_gpu_instance)
+      ncnn::destroy_gpu_instance();
+    g_gpu_instance = false;
+  }
+}
+
 static void VS_CC filterFree(void *instanceData, VSCore *core, const VSAPI *vsapi)
 {
   FilterData *d = static_cast<FilterData *>(instanceData);
   vsapi->freeNode(d->node);
 
-  delete d->realesrgan;
+  if (d->timing && d->timedFrames > 0)
+  {
+    std::string summary = std::format("RealESRGAN: {} frames, ms per frame:", d->timedFrames.load());
+    for (int s = 0; s < RealESRGANStageTimes::StageCount; s++)
+      summary += std::format(" {} {:.2f}", RealESRGANStageTimes::name(static_cast<RealESRGANStageTimes::Stage>(s)),
+                             d->totalTimes.ms[s] / d->timedFrames);
+    vsapi->logMessage(mtDebug, summary.c_str());
+  }
+
+  if (d->frameCache.budget > 0)
+  {
+    vsapi->logMessage(mtDebug, std::format("RealESRGAN: frame cache {} hits, {} misses", d->frameCache.hits.load(),
+                                           d->frameCache.misses.load())
+                                   .c_str());
+    for (auto &entry : d->frameCache.frames)
+      vsapi->freeFrame(entry.second);
+  }
+
   delete d;
 
+  releaseInstance();
+}
+
+// Per-user cache directory, empty when none can be determined
+static fs::path cacheDir()
+{
+#ifdef _WIN32
+  if (const char *local = std::getenv("LOCALAPPDATA"))
+    return fs::path{local} / "vsrealesrgan";
+#else
+  if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+    return fs::path{xdg} / "vsrealesrgan";
+  if (const char *home = std::getenv("HOME"))
+    return fs::path{home} / ".cache" / "vsrealesrgan";
+#endif
+  return {};
+}
+
+// Tuned tile sizes are stored one per line as "<key> <tilesize> <tilesize_y>", the last matching line wins
+static bool loadTunedTileSize(const std::string &key, int &tilesize, int &tilesize_y)
+{
+  const fs::path dir = cacheDir();
+  if (dir.empty())
+    return false;
+
+  std::ifstream f(dir / "tilesize.txt");
+  bool found = false;
+  std::string line;
+  while (std::getline(f, line))
+  {
+    const size_t sep = line.find_last_of('\t');
+    if (sep == std::string::npos || line.compare(0, sep, key) != 0 || sep != key.size())
+      continue;
+
+    std::istringstream values(line.substr(sep + 1));
+    int tx, ty;
+    if (values >> tx >> ty && tx >= 32 && ty >= 32)
+    {
+      tilesize = tx;
+      tilesize_y = ty;
+      found = true;
+    }
+  }
+  return found;
+}
+
+static void saveTunedTileSize(const std::string &key, int tilesize, int tilesize_y)
+{
+  const fs::path dir = cacheDir();
+  if (dir.empty())
+    return;
+
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  std::ofstream f(dir / "tilesize.txt", std::ios::app);
+  f << key << '\t' << tilesize << ' ' << tilesize_y << '\n';
+}
+
+// Time every candidate tile size on a blank frame of the clip's format and keep the fastest. Candidates are
+// limited to twice the heap budget tile size per side so the slowest device still fits, and a candidate whose
+// processing fails is skipped. Returns false when no candidate succeeded.
+static bool tuneTileSize(RealESRGAN *realesrgan, const VSVideoInfo *vi, int max_tilesize, int &tilesize, int &tilesize_y)
+{
+  const VSFormat *fi = vi->format;
+
+  std::vector<std::vector<uint8_t>> src(fi->numPlanes), dst(fi->numPlanes);
+  const uint8_t *srcp[3];
+  uint8_t *dstp[3];
+  int src_stride[3], dst_stride[3];
+  for (int i = 0; i < fi->numPlanes; i++)
+  {
+    const int w = i ? vi->width >> fi->subSamplingW : vi->width;
+    const int h = i ? vi->height >> fi->subSamplingH : vi->height;
+    const int dw = i ? realesrgan->out_width >> fi->subSamplingW : realesrgan->out_width;
+    const int dh = i ? realesrgan->out_height >> fi->subSamplingH : realesrgan->out_height;
+    src_stride[i] = w * fi->bytesPerSample;
+    dst_stride[i] = dw * fi->bytesPerSample;
+    src[i].assign(static_cast<size_t>(src_stride[i]) * h, 0);
+    dst[i].resize(static_cast<size_t>(dst_stride[i]) * dh);
+    srcp[i] = src[i].data();
+    dstp[i] = dst[i].data();
+  }
+
+  const long long max_area = static_cast<long long>(max_tilesize) * max_tilesize;
+  std::vector<std::pair<int, int>> candidates;
+  for (int s : {32, 64, 96, 128, 192, 256, 320, 400, 512, 640, 768})
+  {
+    if (s <= max_tilesize)
+      candidates.emplace_back(std::min(s, vi->width), std::min(s, vi->height));
+  }
+  for (int s : {64, 128, 256})
+  {
+    if (static_cast<long long>(vi->width) * s <= max_area)
+      candidates.emplace_back(vi->width, std::min(s, vi->height));
+  }
+  if (static_cast<long long>(vi->width) * vi->height <= max_area)
+    candidates.emplace_back(vi->width, vi->height);
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+  // a candidate running out of memory fails instead of being timed with smaller tiles
+  realesrgan->retry_smaller_tiles = false;
+
+  double best = 0;
+  for (const auto &[tx, ty] : candidates)
+  {
+    realesrgan->tilesize = tx;
+    realesrgan->tilesize_y = ty;
+
+    // one warm-up run allocates the tile buffers, the best of two timed runs counts
+    if (realesrgan->process(srcp, dstp, vi->width, vi->height, src_stride, dst_stride) != 0)
+      continue;
+
+    double elapsed = 0;
+    for (int run = 0; run < 2; run++)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      if (realesrgan->process(srcp, dstp, vi->width, vi->height, src_stride, dst_stride) != 0)
+      {
+        elapsed = 0;
+        break;
+      }
+      const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      elapsed = run ? std::min(elapsed, ms) : ms;
+    }
+
+    if (elapsed > 0 && (best == 0 || elapsed < best))
+    {
+      best = elapsed;
+      tilesize = tx;
+      tilesize_y = ty;
+    }
+  }
+
+  realesrgan->retry_smaller_tiles = true;
+
+  // the buffers of the largest candidate would stay allocated and counted against max_vram_mb for the whole clip
+  realesrgan->release_buffers();
+
+  return best > 0;
+}
+
+// Creates the Vulkan instance on first use, called with g_lock held
+static void createGpuInstance()
+{
+  if (!g_gpu_instance)
+  {
+    ncnn::create_gpu_instance();
+    g_gpu_instance = true;
+  }
+}
+
+// Checks the device ids against the devices present, without any the first GPU or else the CPU. Called with g_lock held
+static void resolveGpuIds(FilterOptions &o)
+{
+  for (int gpuId : o.gpuIds)
+  {
+    if (gpuId >= ncnn::get_gpu_count())
+      throw std::string{"invalid 'gpu_id'"};
+  }
+  if (o.gpuIds.empty())
+    o.gpuIds.push_back(ncnn::get_gpu_count() > 0 ? 0 : -1);
+  if (o.precision == 3 && std::any_of(o.gpuIds.begin(), o.gpuIds.end(), [](int gpuId) { return gpuId >= 0; }))
+    throw std::string{"int8 precision is only supported on the CPU, gpu_id=-1"};
+}
+
+// Loaded models are shared between filter instances by gpu id, model files, fp16 options and tta. Called with g_lock held
+static std::shared_ptr<const RealESRGANModel> loadModel(const FilterOptions &o, int gpuId, const VSAPI *vsapi)
+{
+  auto sharedModel = std::make_shared<RealESRGANModel>(gpuId, o.tta);
+  if (gpuId < 0)
+  {
+    ncnn::Option &cpuOpt = sharedModel->net.opt;
+    cpuOpt.num_threads = o.cpuThreads;
+    cpuOpt.use_packing_layout = o.cpuPacking;
+    cpuOpt.use_fp16_packed = o.cpuHalf == 1;
+    cpuOpt.use_fp16_storage = o.cpuHalf == 1;
+    cpuOpt.use_fp16_arithmetic = o.cpuHalf == 1;
+    cpuOpt.use_bf16_storage = o.cpuHalf == 2;
+  }
+  if (o.precision >= 0)
+    sharedModel->set_precision(o.precision);
+  const ncnn::Option &opt = sharedModel->net.opt;
+  const std::string modelKey = std::format("{}|{}|{}|{}{}{}{}{}{}|{}|{}", gpuId, o.paramPath, o.modelPath, opt.use_fp16_packed ? 1 : 0,
+                                           opt.use_fp16_storage ? 1 : 0, opt.use_fp16_arithmetic ? 1 : 0,
+                                           opt.use_bf16_storage ? 1 : 0, opt.use_int8_storage ? 1 : 0,
+                                           opt.use_packing_layout ? 1 : 0, opt.num_threads, o.tta ? 1 : 0);
+  if (auto it = g_models.find(modelKey); it != g_models.end())
+    return it->second;
+
+  if (sharedModel->load(o.paramPath, o.modelPath) != 0)
+    throw std::string{"can't load model " + o.paramPath};
+  g_models.emplace(modelKey, sharedModel);
+  vsapi->logMessage(mtDebug, std::format("RealESRGAN: loaded {} on gpu {}, {}x, blobs {} -> {}", fs::path(o.paramPath).filename().string(),
+                                         gpuId, sharedModel->scale, sharedModel->input_name, sharedModel->output_name)
+                                 .c_str());
+  return std::shared_ptr<const RealESRGANModel>{sharedModel};
+}
+
+// Creates the GPU instance, loads the models and sets up every device, throws on failure
+static void initGpus(FilterData *d, const VSAPI *vsapi)
+{
+  FilterOptions &o = d->options;
+
   std::lock_guard<std::mutex> guard(g_lock);
-  g_filter_instance_count--;
-  if (g_filter_instance_count == 0)
+
+  createGpuInstance();
+  resolveGpuIds(o);
+
+  for (int gpuId : o.gpuIds)
   {
-    ncnn::destroy_gpu_instance();
-    for (auto pair : g_gpu_semaphore)
+    // More fine-grained tilesize policy here
+    uint32_t heap_budget = gpuId >= 0 ? ncnn::get_gpu_device(gpuId)->get_heap_budget() : 0;
+    int auto_tilesize;
+    if (gpuId < 0)
+      auto_tilesize = 200;
+    else if (heap_budget > 2600)
+      auto_tilesize = 400;
+    else if (heap_budget > 740)
+      auto_tilesize = 200;
+    else if (heap_budget > 250)
+      auto_tilesize = 100;
+    else
+      auto_tilesize = 32;
+    int tilesize = o.customTilesize ? o.customTilesize : auto_tilesize;
+    int tilesize_y = o.customTilesizeY ? o.customTilesizeY : auto_tilesize;
+    if (o.tileMode >= 1)
+      tilesize = d->vi->width;
+    if (o.tileMode == 2)
+      tilesize_y = d->vi->height;
+
+    FilterGpu gpu{};
+    if (gpuId >= 0)
     {
-      delete pair.second;
+      int gpuThread;
+      if (o.customGpuThread > 0)
+        gpuThread = o.customGpuThread;
+      else
+        gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
+      gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
+
+      // one submission thread per queue, with room for as many waiting tile rows
+      if (!g_gpu_scheduler.count(gpuId))
+        g_gpu_scheduler.insert(std::pair<int, GpuScheduler *>(gpuId, new GpuScheduler(gpuThread, gpuThread)));
+      gpu.scheduler = g_gpu_scheduler.at(gpuId);
+      gpu.threads = gpu.scheduler->threads();
+    }
+    else
+    {
+      // the CPU network runs on the calling thread with cpu_threads workers
+      gpu.scheduler = nullptr;
+      gpu.threads = 1;
     }
-    g_gpu_semaphore.clear();
+
+    std::shared_ptr<const RealESRGANModel> sharedModel = loadModel(o, gpuId, vsapi);
+    gpu.realesrgan = std::make_unique<RealESRGAN>(sharedModel);
+    RealESRGAN *realesrgan = gpu.realesrgan.get();
+    realesrgan->scale = sharedModel->scale;
+    realesrgan->out_width = d->target_width;
+    realesrgan->out_height = d->target_height;
+    realesrgan->tilesize = tilesize;
+    realesrgan->tilesize_y = tilesize_y;
+    realesrgan->prepadding = 10;
+    realesrgan->pipeline_depth = o.pipelineDepth;
+    realesrgan->bits_per_sample = d->vi->format->bitsPerSample;
+    realesrgan->float_sample = d->vi->format->sampleType == stFloat;
+    realesrgan->yuv = d->vi->format->colorFamily == cmYUV;
+    realesrgan->chroma_ssw = d->vi->format->subSamplingW;
+    realesrgan->chroma_ssh = d->vi->format->subSamplingH;
+    realesrgan->matrix = o.matrix;
+    realesrgan->full_range = o.fullRange;
+    realesrgan->scheduler = gpu.scheduler;
+    realesrgan->half_download = o.halfDownload;
+    // Without a budget the device heap budget applies, queried once the weights are loaded. ncnn does not report
+    // allocations failing on the device itself, so the budget is what turns running out into smaller tiles
+    realesrgan->max_vram_mb = o.maxVramMb > 0 || gpuId < 0 ? o.maxVramMb : static_cast<int>(ncnn::get_gpu_device(gpuId)->get_heap_budget());
+
+    // Tile size auto-tune, the result is cached per device, driver, model, scale, tta, network precision, frame and
+    // output size. The precision is the fp16, bf16 and int8 options the model was loaded with, as in the model key
+    if (o.autotune)
+    {
+      const std::string device = gpuId >= 0 ? std::format("{} {}", ncnn::get_gpu_info(gpuId).device_name(), ncnn::get_gpu_info(gpuId).driver_version())
+                                            : std::format("cpu {} threads", o.cpuThreads);
+      const ncnn::Option &opt = sharedModel->net.opt;
+      std::string key = std::format("{} {} x{} tta{} opt{}{}{}{}{}{} {}x{} {}", device,
+                                    fs::path(o.paramPath).filename().string(), sharedModel->scale, o.tta ? 1 : 0,
+                                    opt.use_fp16_packed ? 1 : 0, opt.use_fp16_storage ? 1 : 0, opt.use_fp16_arithmetic ? 1 : 0,
+                                    opt.use_bf16_storage ? 1 : 0, opt.use_int8_storage ? 1 : 0, opt.use_packing_layout ? 1 : 0,
+                                    d->vi->width, d->vi->height, d->vi->format->name);
+      if (d->target_width != d->vi->width * sharedModel->scale || d->target_height != d->vi->height * sharedModel->scale)
+        key += std::format(" to {}x{}", d->target_width, d->target_height);
+
+      if (!loadTunedTileSize(key, tilesize, tilesize_y))
+      {
+        bool tuned = tuneTileSize(realesrgan, d->vi, auto_tilesize * 2, tilesize, tilesize_y);
+
+        if (tuned)
+          saveTunedTileSize(key, tilesize, tilesize_y);
+      }
+
+      realesrgan->tilesize = tilesize;
+      realesrgan->tilesize_y = tilesize_y;
+    }
+
+    // Enabled after tuning, which processes the same frame over and over
+    realesrgan->skip_threshold = o.skipThreshold;
+
+    d->gpus.push_back(std::move(gpu));
   }
 }
 
@@ -148,71 +724,106 @@ static void VS_CC filterCreate(const VSMap *in, VSMap *out, void *userData, VSCo
 
   {
     std::lock_guard<std::mutex> guard(g_lock);
-
-    if (g_filter_instance_count == 0)
-    {
-      ncnn::create_gpu_instance();
-    }
-
     g_filter_instance_count++;
   }
 
   try
   {
     if (!isConstantFormat(d->vi) ||
-        d->vi->format->sampleType == stInteger ||
-        (d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample != 32))
-      throw std::string{"only constant format 32 bits float input supported"};
+        (d->vi->format->colorFamily != cmRGB && d->vi->format->colorFamily != cmYUV) ||
+        (d->vi->format->sampleType == stInteger && d->vi->format->bitsPerSample > 16) ||
+        (d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample != 16 && d->vi->format->bitsPerSample != 32))
+      throw std::string{"only constant format RGB or YUV input with 8-16 bits integer or 16/32 bits float samples supported"};
+
+    if (d->vi->format->subSamplingW > 1 || d->vi->format->subSamplingH > 1)
+      throw std::string{"only 4:4:4, 4:2:2, 4:4:0 and 4:2:0 chroma subsampling supported"};
+
+    // YUV matrix coefficients, as in _Matrix
+    int matrix = int64ToIntS(vsapi->propGetInt(in, "matrix", 0, &err));
+    if (err)
+      matrix = (d->vi->width > 1024 || d->vi->height > 576) ? 1 : 6;
+    if (matrix != 1 && matrix != 4 && matrix != 5 && matrix != 6 && matrix != 7 && matrix != 9)
+      throw std::string{"matrix must be 1, 4, 5, 6, 7 or 9"};
+
+    bool fullRange = !!vsapi->propGetInt(in, "range", 0, &err);
 
     int scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
+    const bool customScale = !err;
     if (err || scale < 2)
       scale = 2;
     if (scale > 4)
       throw std::string{"model is only supported up to 4x scale"};
 
-    d->target_width = d->vi->width * scale;
-    d->target_height = d->vi->height * scale;
-
-    // Model path
-    const std::string pluginPath{vsapi->getPluginPath(vsapi->getPluginById("com.vapoursynth.realesrgan", core))};
-    std::string paramPath{pluginPath.substr(0, pluginPath.find_last_of('/'))};
-    std::string modelPath{pluginPath.substr(0, pluginPath.find_last_of('/'))};
-
     int model = int64ToIntS(vsapi->propGetInt(in, "model", 0, &err));
     if (err)
       model = 0;
 
-    /*
-    /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x2.bin
-    /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x2.param
-    /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x3.bin
-    /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x3.param
-    /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x4.bin
-    /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x4.param
-    /usr/share/realesrgan-ncnn-vulkan/models/realesrgan-x4plus-anime.bin
-    /usr/share/realesrgan-ncnn-vulkan/models/realesrgan-x4plus-anime.param
-    /usr/share/realesrgan-ncnn-vulkan/models/realesrgan-x4plus.bin
-    /usr/share/realesrgan-ncnn-vulkan/models/realesrgan-x4plus.param
-    /usr/share/realesrgan-ncnn-vulkan/models/realesrnet-x4plus.bin
-    /usr/share/realesrgan-ncnn-vulkan/models/realesrnet-x4plus.param
-    */
-    if (model == 0)
+    // Requested output size, completed once the network scale is known
+    int width = int64ToIntS(vsapi->propGetInt(in, "width", 0, &err));
+    int height = int64ToIntS(vsapi->propGetInt(in, "height", 0, &err));
+    if (width < 0 || height < 0)
+      throw std::string{"width and height must be positive"};
+
+    // Network scale of the built-in models, models 1 and 2 are 4x only. Without a scale, the smallest one reaching the
+    // output size
+    int modelScale = scale;
+    if (model == 1 || model == 2)
+      modelScale = 4;
+    else if (!customScale)
     {
-      paramPath += std::format("/models/realesr-animevideov3-x{}.param", scale).c_str();
-      modelPath += std::format("/models/realesr-animevideov3-x{}.bin", scale).c_str();
+      while (modelScale < 4 && (d->vi->width * modelScale < width || d->vi->height * modelScale < height))
+        modelScale++;
     }
-    else if (model == 1)
+
+    // Model path, custom models replace the model index and have their blob names and scale probed when loaded
+    std::string paramPath;
+    std::string modelPath;
+    const char *customParamPath = vsapi->propGetData(in, "param_path", 0, &err);
+    const bool customModel = !err;
+    if (customModel)
     {
-      paramPath += "/models/realesrgan-x4plus-anime.param";
-      modelPath += "/models/realesrgan-x4plus-anime.bin";
+      paramPath = customParamPath;
+      const char *customBinPath = vsapi->propGetData(in, "bin_path", 0, &err);
+      modelPath = err ? fs::path{paramPath}.replace_extension(".bin").string() : std::string{customBinPath};
     }
-    else if (model == 2)
+    else
     {
-      paramPath += "/models/realesrgan-x4plus.param";
-      modelPath += "/models/realesrgan-x4plus.bin";
+      const std::string pluginPath{vsapi->getPluginPath(vsapi->getPluginById("com.vapoursynth.realesrgan", core))};
+      paramPath = pluginPath.substr(0, pluginPath.find_last_of('/'));
+      modelPath = pluginPath.substr(0, pluginPath.find_last_of('/'));
+
+      /*
+      /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x2.bin
+      /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x2.param
+      /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x3.bin
+      /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x3.param
+      /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x4.bin
+      /usr/share/realesrgan-ncnn-vulkan/models/realesr-animevideov3-x4.param
+      /usr/share/realesrgan-ncnn-vulkan/models/realesrgan-x4plus-anime.bin
+      /usr/share/realesrgan-ncnn-vulkan/models/realesrgan-x4plus-anime.param
+      /usr/share/realesrgan-ncnn-vulkan/models/realesrgan-x4plus.bin
+      /usr/share/realesrgan-ncnn-vulkan/models/realesrgan-x4plus.param
+      /usr/share/realesrgan-ncnn-vulkan/models/realesrnet-x4plus.bin
+      /usr/share/realesrgan-ncnn-vulkan/models/realesrnet-x4plus.param
+      */
+      if (model == 0)
+      {
+        paramPath += std::format("/models/realesr-animevideov3-x{}.param", modelScale).c_str();
+        modelPath += std::format("/models/realesr-animevideov3-x{}.bin", modelScale).c_str();
+      }
+      else if (model == 1)
+      {
+        paramPath += "/models/realesrgan-x4plus-anime.param";
+        modelPath += "/models/realesrgan-x4plus-anime.bin";
+      }
+      else if (model == 2)
+      {
+        paramPath += "/models/realesrgan-x4plus.param";
+        modelPath += "/models/realesrgan-x4plus.bin";
+      }
+      else
+        throw std::string{"invalid model type. Try 0, 1, 2"};
     }
-    else
-      throw std::string{"invalid model type. Try 0, 1, 2"};
 
     // Check model file readable
     std::ifstream pf(paramPath);
@@ -220,70 +831,143 @@ static void VS_CC filterCreate(const VSMap *in, VSMap *out, void *userData, VSCo
     if (!pf.good() || !mf.good())
       throw std::string{"can't open model file"};
 
-    // GPU id
-    int gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", 0, &err));
-    if (err)
-      gpuId = 0;
-    if (gpuId < 0 || gpuId >= ncnn::get_gpu_count())
-      throw std::string{"invalid 'gpu_id'"};
+    FilterOptions &o = d->options;
+    o.paramPath = paramPath;
+    o.modelPath = modelPath;
+    o.matrix = matrix;
+    o.fullRange = fullRange;
+
+    // GPU ids, frames are distributed between all listed devices, -1 is the CPU. Checked against the devices present
+    // once the GPU instance exists
+    int numGpuIds = vsapi->propNumElements(in, "gpu_id");
+    for (int i = 0; i < numGpuIds; i++)
+    {
+      int gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", i, nullptr));
+      if (gpuId < -1)
+        throw std::string{"invalid 'gpu_id'"};
+      if (std::find(o.gpuIds.begin(), o.gpuIds.end(), gpuId) != o.gpuIds.end())
+        throw std::string{"'gpu_id' must not contain duplicates"};
+      o.gpuIds.push_back(gpuId);
+    }
 
     // Tile size
-    int tilesize = int64ToIntS(vsapi->propGetInt(in, "tilesize", 0, &err));
+    o.customTilesize = int64ToIntS(vsapi->propGetInt(in, "tilesize", 0, &err));
     if (err)
-      tilesize = 100;
-    if (tilesize != 0 && tilesize < 32)
+      o.customTilesize = 100;
+    if (o.customTilesize != 0 && o.customTilesize < 32)
       throw std::string{"tilesize must be >= 32 or set as 0"};
 
-    int tilesize_y = int64ToIntS(vsapi->propGetInt(in, "tilesize_y", 0, &err));
+    o.customTilesizeY = int64ToIntS(vsapi->propGetInt(in, "tilesize_y", 0, &err));
     if (err)
-      tilesize_y = tilesize;
-    if (tilesize_y != 0 && tilesize_y < 32)
+      o.customTilesizeY = o.customTilesize;
+    if (o.customTilesizeY != 0 && o.customTilesizeY < 32)
       throw std::string{"tilesize_y must be >= 32 or set as 0"};
 
-    // More fine-grained tilesize policy here
-    uint32_t heap_budget = ncnn::get_gpu_device(gpuId)->get_heap_budget();
-    if (tilesize == 0)
-    {
-      if (heap_budget > 2600)
-        tilesize = 400;
-      else if (heap_budget > 740)
-        tilesize = 200;
-      else if (heap_budget > 250)
-        tilesize = 100;
-      else
-        tilesize = 32;
-    }
+    // 0 = tiles, 1 = full-width strips of tilesize_y rows, 2 = whole frame in one tile
+    o.tileMode = int64ToIntS(vsapi->propGetInt(in, "tile_mode", 0, &err));
+    if (err)
+      o.tileMode = 0;
+    if (o.tileMode < 0 || o.tileMode > 2)
+      throw std::string{"tile_mode must be 0, 1 or 2"};
 
-    int gpuThread;
-    int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
-    if (customGpuThread > 0)
-      gpuThread = customGpuThread;
-    else
-      gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
-    gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
+    o.customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
 
-    std::lock_guard<std::mutex> guard(g_lock);
-    if (!g_gpu_semaphore.count(gpuId))
-      g_gpu_semaphore.insert(std::pair<int, Semaphore *>(gpuId, new Semaphore(gpuThread)));
-    d->gpuSemaphore = g_gpu_semaphore.at(gpuId);
+    o.tta = !!vsapi->propGetInt(in, "tta", 0, &err);
 
-    bool tta = !!vsapi->propGetInt(in, "tta", 0, &err);
+    o.pipelineDepth = int64ToIntS(vsapi->propGetInt(in, "pipeline_depth", 0, &err));
+    if (err)
+      o.pipelineDepth = 1;
+    if (o.pipelineDepth < 1)
+      throw std::string{"pipeline_depth must be >= 1"};
 
-    d->realesrgan = new RealESRGAN(gpuId, tta);
-    d->realesrgan->scale = scale;
-    d->realesrgan->tilesize = tilesize;
-    d->realesrgan->prepadding = 10;
-    d->realesrgan->load(paramPath, modelPath);
-  }
-  catch (const std::string &error)
-  {
+    o.autotune = !!vsapi->propGetInt(in, "autotune", 0, &err);
+
+    // Tiles whose input changed by at most this fraction of full scale reuse the previous output, negative disables
+    o.skipThreshold = (float)vsapi->propGetFloat(in, "skip_threshold", 0, &err);
+    if (err)
+      o.skipThreshold = -1.f;
+    if (o.skipThreshold > 1.f)
+      throw std::string{"skip_threshold must be <= 1"};
+
+    // Download RGBS tile rows as fp16
+    o.halfDownload = !!vsapi->propGetInt(in, "half_download", 0, &err);
+
+    // Device memory budget of the tile buffers in MiB, 0 for the device heap budget
+    o.maxVramMb = int64ToIntS(vsapi->propGetInt(in, "max_vram_mb", 0, &err));
+    if (o.maxVramMb < 0)
+      throw std::string{"max_vram_mb must be >= 0"};
+
+    d->timing = !!vsapi->propGetInt(in, "timing", 0, &err);
+
+    // Output frame cache budget in MiB, 0 disables
+    int cacheMb = int64ToIntS(vsapi->propGetInt(in, "cache_mb", 0, &err));
+    if (cacheMb < 0)
+      throw std::string{"cache_mb must be >= 0"};
+    d->frameCache.budget = static_cast<size_t>(cacheMb) << 20;
+
+    // CPU backend options
+    o.cpuThreads = int64ToIntS(vsapi->propGetInt(in, "cpu_threads", 0, &err));
+    if (err || o.cpuThreads <= 0)
+      o.cpuThreads = ncnn::get_big_cpu_count();
+
+    o.cpuPacking = !!vsapi->propGetInt(in, "cpu_packing", 0, &err);
+    if (err)
+      o.cpuPacking = true;
+
+    // 0 = fp32, 1 = fp16 storage and arithmetic where the CPU supports it, 2 = bf16 storage
+    o.cpuHalf = int64ToIntS(vsapi->propGetInt(in, "cpu_half", 0, &err));
+    if (o.cpuHalf < 0 || o.cpuHalf > 2)
+      throw std::string{"cpu_half must be 0, 1 or 2"};
+
+    // 0 = fp32, 1 = fp16 storage, 2 = fp16 storage and arithmetic, 3 = int8 quantized model, -1 = device default
+    o.precision = int64ToIntS(vsapi->propGetInt(in, "precision", 0, &err));
+    if (err)
+      o.precision = -1;
+    if (o.precision < -1 || o.precision > 3)
+      throw std::string{"precision must be 0, 1, 2 or 3"};
+
+    // Devices and models are set up on the first frame request, custom models need a scale as theirs is only known
+    // once loaded
+    d->lazy = !!vsapi->propGetInt(in, "lazy", 0, &err);
+    if (d->lazy && customModel && !customScale)
+      throw std::string{"lazy needs a scale with param_path"};
+
+    // Without a scale, custom models keep their own
+    if (customModel && !customScale)
     {
       std::lock_guard<std::mutex> guard(g_lock);
+      createGpuInstance();
+      resolveGpuIds(o);
+      scale = loadModel(o, o.gpuIds[0], vsapi)->scale;
+    }
 
-      g_filter_instance_count--;
-      if (g_filter_instance_count == 0)
-        ncnn::destroy_gpu_instance();
+    // Output size, a missing side follows the aspect ratio and both default to the clip size times scale
+    const int ssw = d->vi->format->subSamplingW;
+    const int ssh = d->vi->format->subSamplingH;
+    if (width == 0 && height == 0)
+    {
+      width = d->vi->width * scale;
+      height = d->vi->height * scale;
     }
+    else if (width == 0)
+      width = std::max(static_cast<int>(std::lround(static_cast<double>(height) * d->vi->width / d->vi->height / (1 << ssw))), 1) << ssw;
+    else if (height == 0)
+      height = std::max(static_cast<int>(std::lround(static_cast<double>(width) * d->vi->height / d->vi->width / (1 << ssh))), 1) << ssh;
+    if (width % (1 << ssw) || height % (1 << ssh))
+      throw std::string{"width and height must be multiples of the chroma subsampling"};
+    if (width < d->vi->width || height < d->vi->height)
+      throw std::string{"width and height must not be smaller than the clip"};
+
+    d->target_width = width;
+    d->target_height = height;
+
+    if (!d->lazy)
+      initGpus(d.get(), vsapi);
+  }
+  catch (const std::string &error)
+  {
+    d->gpus.clear();
+    releaseInstance();
 
     vsapi->setError(out, ("RealESRGAN: " + error).c_str());
     vsapi->freeNode(d->node);
@@ -300,10 +984,30 @@ VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc
   registerFunc("RealESRGAN",
                "clip:clip;"
                "scale:int:opt;"
+               "width:int:opt;"
+               "height:int:opt;"
                "tilesize:int:opt;"
+               "tilesize_y:int:opt;"
+               "tile_mode:int:opt;"
                "model:int:opt;"
-               "gpu_id:int:opt;"
+               "param_path:data:opt;"
+               "bin_path:data:opt;"
+               "gpu_id:int[]:opt;"
                "gpu_thread:int:opt;"
-               "tta:int:opt",
+               "cpu_threads:int:opt;"
+               "cpu_packing:int:opt;"
+               "cpu_half:int:opt;"
+               "precision:int:opt;"
+               "tta:int:opt;"
+               "pipeline_depth:int:opt;"
+               "matrix:int:opt;"
+               "range:int:opt;"
+               "autotune:int:opt;"
+               "skip_threshold:float:opt;"
+               "half_download:int:opt;"
+               "max_vram_mb:int:opt;"
+               "timing:int:opt;"
+               "cache_mb:int:opt;"
+               "lazy:int:opt",
                filterCreate, 0, plugin);
 }
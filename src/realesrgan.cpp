@@ -3,26 +3,35 @@
 #include "realesrgan.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <map>
 #include <vector>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+
+// ncnn
+#include "cpu.h"
+
 static const uint32_t realesrgan_preproc_spv_data[] = {
     #include "realesrgan_preproc.spv.hex.h"
 };
 static const uint32_t realesrgan_preproc_fp16s_spv_data[] = {
     #include "realesrgan_preproc_fp16s.spv.hex.h"
 };
-static const uint32_t realesrgan_preproc_int8s_spv_data[] = {
-    #include "realesrgan_preproc_int8s.spv.hex.h"
-};
 static const uint32_t realesrgan_postproc_spv_data[] = {
     #include "realesrgan_postproc.spv.hex.h"
 };
 static const uint32_t realesrgan_postproc_fp16s_spv_data[] = {
     #include "realesrgan_postproc_fp16s.spv.hex.h"
 };
-static const uint32_t realesrgan_postproc_int8s_spv_data[] = {
-    #include "realesrgan_postproc_int8s.spv.hex.h"
-};
 
 static const uint32_t realesrgan_preproc_tta_spv_data[] = {
     #include "realesrgan_preproc_tta.spv.hex.h"
@@ -30,29 +39,26 @@ static const uint32_t realesrgan_preproc_tta_spv_data[] = {
 static const uint32_t realesrgan_preproc_tta_fp16s_spv_data[] = {
     #include "realesrgan_preproc_tta_fp16s.spv.hex.h"
 };
-static const uint32_t realesrgan_preproc_tta_int8s_spv_data[] = {
-    #include "realesrgan_preproc_tta_int8s.spv.hex.h"
-};
 static const uint32_t realesrgan_postproc_tta_spv_data[] = {
     #include "realesrgan_postproc_tta.spv.hex.h"
 };
 static const uint32_t realesrgan_postproc_tta_fp16s_spv_data[] = {
     #include "realesrgan_postproc_tta_fp16s.spv.hex.h"
 };
-static const uint32_t realesrgan_postproc_tta_int8s_spv_data[] = {
-    #include "realesrgan_postproc_tta_int8s.spv.hex.h"
-};
 
-RealESRGAN::RealESRGAN(int gpuid, bool _tta_mode)
+RealESRGANModel::RealESRGANModel(int gpuid, bool _tta_mode)
 {
-    net.opt.use_vulkan_compute = true;
-    net.opt.use_fp16_packed = true;
-    net.opt.use_fp16_storage = true;
+    // gpuid -1 runs the network on the cpu, the caller may tune the cpu options before load
+    net.opt.use_vulkan_compute = gpuid >= 0;
+    net.opt.use_fp16_packed = gpuid >= 0;
+    net.opt.use_fp16_storage = gpuid >= 0;
     net.opt.use_fp16_arithmetic = false;
+    net.opt.use_bf16_storage = false;
     net.opt.use_int8_storage = false;
     net.opt.use_int8_arithmetic = false;
 
-    net.set_vulkan_device(gpuid);
+    if (gpuid >= 0)
+        net.set_vulkan_device(gpuid);
 
     realesrgan_preproc = 0;
     realesrgan_postproc = 0;
@@ -60,9 +66,12 @@ RealESRGAN::RealESRGAN(int gpuid, bool _tta_mode)
     bicubic_3x = 0;
     bicubic_4x = 0;
     tta_mode = _tta_mode;
+    input_name = "data";
+    output_name = "output";
+    scale = 0;
 }
 
-RealESRGAN::~RealESRGAN()
+RealESRGANModel::~RealESRGANModel()
 {
     // cleanup preprocess and postprocess pipeline
     {
@@ -70,20 +79,113 @@ RealESRGAN::~RealESRGAN()
         delete realesrgan_postproc;
     }
 
-    bicubic_2x->destroy_pipeline(net.opt);
-    delete bicubic_2x;
+    if (bicubic_2x)
+    {
+        bicubic_2x->destroy_pipeline(net.opt);
+        delete bicubic_2x;
+    }
+
+    if (bicubic_3x)
+    {
+        bicubic_3x->destroy_pipeline(net.opt);
+        delete bicubic_3x;
+    }
+
+    if (bicubic_4x)
+    {
+        bicubic_4x->destroy_pipeline(net.opt);
+        delete bicubic_4x;
+    }
+}
+
+void RealESRGANModel::set_precision(int precision)
+{
+    net.opt.use_fp16_packed = precision == 1 || precision == 2;
+    net.opt.use_fp16_storage = precision == 1 || precision == 2;
+    net.opt.use_fp16_arithmetic = precision == 2;
+    net.opt.use_bf16_storage = false;
+
+    // layers quantized by ncnn2int8 with a calibration table run in int8 whatever the precision, others in
+    // fp32 under int8
+    net.opt.use_int8_inference = true;
+    net.opt.use_int8_packed = precision == 3;
+    net.opt.use_int8_storage = precision == 3;
+    net.opt.use_int8_arithmetic = precision == 3;
+}
+
+// blob names and scale of the loaded network, models converted by other tools need not use data and output
+int RealESRGANModel::probe()
+{
+    if (!net.input_names().empty())
+        input_name = net.input_names()[0];
+    if (!net.output_names().empty())
+        output_name = net.output_names()[0];
+
+    // the scale is the output size of a small test inference over its input size
+    const int size = 16;
+
+    ncnn::Mat in(size, size, 3);
+    in.fill(0.5f);
+
+    ncnn::Extractor ex = net.create_extractor();
+
+    ex.input(input_name.c_str(), in);
+
+    ncnn::Mat out;
+    int ret = ex.extract(output_name.c_str(), out);
+    if (ret != 0)
+        return ret;
+
+    if (out.dims != 3 || out.c != 3 || out.w % size != 0 || out.w != out.h || out.w < size)
+    {
+        fprintf(stderr, "%s %dx%dx%d output for %dx%dx3 input is no integer upscale\n", output_name.c_str(), out.w, out.h, out.c, size, size);
+        return -1;
+    }
+
+    scale = out.w / size;
+
+    return 0;
+}
+
+RealESRGAN::RealESRGAN(std::shared_ptr<const RealESRGANModel> _model) : model(std::move(_model))
+{
+    pipeline_depth = 1;
+    bits_per_sample = 32;
+    float_sample = true;
+    yuv = false;
+    chroma_ssw = 0;
+    chroma_ssh = 0;
+    matrix = 1;
+    full_range = false;
+    scheduler = 0;
+    skip_threshold = -1.f;
+    out_width = 0;
+    out_height = 0;
+    half_download = false;
+    max_vram_mb = 0;
+    retry_smaller_tiles = true;
+    tile_limit_x = 0;
+    tile_limit_y = 0;
+    vram_used = 0;
+}
+
+const char* RealESRGANStageTimes::name(Stage stage)
+{
+    static const char* const names[StageCount] = {"pack", "upload", "preproc", "inference", "postproc", "download", "unpack"};
 
-    bicubic_3x->destroy_pipeline(net.opt);
-    delete bicubic_3x;
+    return names[stage];
+}
 
-    bicubic_4x->destroy_pipeline(net.opt);
-    delete bicubic_4x;
+void RealESRGANStageTimes::add(Stage stage, double stage_ms)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    ms[stage] += stage_ms;
 }
 
 #if _WIN32
-int RealESRGAN::load(const std::wstring& parampath, const std::wstring& modelpath)
+int RealESRGANModel::load(const std::wstring& parampath, const std::wstring& modelpath)
 #else
-int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
+int RealESRGANModel::load(const std::string& parampath, const std::string& modelpath)
 #endif
 {
 #if _WIN32
@@ -114,6 +216,13 @@ int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
     net.load_model(modelpath.c_str());
 #endif
 
+    if (probe() != 0)
+        return -1;
+
+    // the cpu path converts frames itself, see RealESRGAN::process_cpu
+    if (!net.opt.use_vulkan_compute)
+        return 0;
+
     // initialize preprocess and postprocess pipeline
     {
         std::vector<ncnn::vk_specialization_type> specializations(1);
@@ -131,32 +240,24 @@ int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
 
         if (tta_mode)
         {
-            if (net.opt.use_fp16_storage && net.opt.use_int8_storage)
-                realesrgan_preproc->create(realesrgan_preproc_tta_int8s_spv_data, sizeof(realesrgan_preproc_tta_int8s_spv_data), specializations);
-            else if (net.opt.use_fp16_storage)
+            if (net.opt.use_fp16_storage)
                 realesrgan_preproc->create(realesrgan_preproc_tta_fp16s_spv_data, sizeof(realesrgan_preproc_tta_fp16s_spv_data), specializations);
             else
                 realesrgan_preproc->create(realesrgan_preproc_tta_spv_data, sizeof(realesrgan_preproc_tta_spv_data), specializations);
 
-            if (net.opt.use_fp16_storage && net.opt.use_int8_storage)
-                realesrgan_postproc->create(realesrgan_postproc_tta_int8s_spv_data, sizeof(realesrgan_postproc_tta_int8s_spv_data), specializations);
-            else if (net.opt.use_fp16_storage)
+            if (net.opt.use_fp16_storage)
                 realesrgan_postproc->create(realesrgan_postproc_tta_fp16s_spv_data, sizeof(realesrgan_postproc_tta_fp16s_spv_data), specializations);
             else
                 realesrgan_postproc->create(realesrgan_postproc_tta_spv_data, sizeof(realesrgan_postproc_tta_spv_data), specializations);
         }
         else
         {
-            if (net.opt.use_fp16_storage && net.opt.use_int8_storage)
-                realesrgan_preproc->create(realesrgan_preproc_int8s_spv_data, sizeof(realesrgan_preproc_int8s_spv_data), specializations);
-            else if (net.opt.use_fp16_storage)
+            if (net.opt.use_fp16_storage)
                 realesrgan_preproc->create(realesrgan_preproc_fp16s_spv_data, sizeof(realesrgan_preproc_fp16s_spv_data), specializations);
             else
                 realesrgan_preproc->create(realesrgan_preproc_spv_data, sizeof(realesrgan_preproc_spv_data), specializations);
 
-            if (net.opt.use_fp16_storage && net.opt.use_int8_storage)
-                realesrgan_postproc->create(realesrgan_postproc_int8s_spv_data, sizeof(realesrgan_postproc_int8s_spv_data), specializations);
-            else if (net.opt.use_fp16_storage)
+            if (net.opt.use_fp16_storage)
                 realesrgan_postproc->create(realesrgan_postproc_fp16s_spv_data, sizeof(realesrgan_postproc_fp16s_spv_data), specializations);
             else
                 realesrgan_postproc->create(realesrgan_postproc_spv_data, sizeof(realesrgan_postproc_spv_data), specializations);
@@ -206,322 +307,1618 @@ int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
 
 constexpr int CHANNELS = 3;
 
-int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int width, int height, int src_stride, int dst_stride) const
+struct RealESRGAN::TileRow
 {
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    // device buffers of the row come from here, released last
+    std::unique_ptr<ncnn::VkAllocator> blob_allocator;
+    // tile row and the result of processing it
+    int yi;
+    int ret;
+    // mapped staging memory, frame planes are copied straight in and out
+    ncnn::VkMat in;
+    ncnn::VkMat out;
+    ncnn::Option opt;
+    std::future<int> pending;
+    // device buffers and command buffer of the row, reused by the next row of the slot
+    ncnn::VkMat in_gpu;
+    ncnn::VkMat out_gpu;
+    ncnn::VkMat in_tile_gpu[8];
+    std::unique_ptr<ncnn::VkCompute> cmd;
+    // tile skipping, per tile of the row the input samples, whether the cache had them and the
+    // cached network output or its copy to be cached, eight per tile
+    std::vector<std::vector<uint8_t>> tile_input;
+    std::vector<char> tile_hit;
+    std::vector<ncnn::VkMat> tile_output;
+};
 
-    ncnn::VkAllocator* blob_vkallocator = net.vulkan_device()->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = net.vulkan_device()->acquire_staging_allocator();
+// network output of a tile kept on the gpu, with the input region and samples it was inferred from
+struct RealESRGAN::CachedTile
+{
+    int x0;
+    int x1;
+    int y0;
+    int y1;
+    std::vector<uint8_t> input;
+    ncnn::VkMat output[8];
+};
 
-    ncnn::Option opt = net.opt;
-    opt.blob_vkallocator = blob_vkallocator;
-    opt.workspace_vkallocator = blob_vkallocator;
-    opt.staging_vkallocator = staging_vkallocator;
+// blob allocator counting its blocks against max_vram_mb, shared by every allocator of the instance
+// the base allocator keeps a block until clear, so a block is charged when first handed out and
+// released on clear or destruction, not when the sub-allocations in it are freed
+class BudgetBlobAllocator : public ncnn::VkBlobAllocator
+{
+public:
+    BudgetBlobAllocator(const ncnn::VulkanDevice* _vkdev, const int* _max_vram_mb, std::atomic<size_t>* _used)
+        : ncnn::VkBlobAllocator(_vkdev, block_size_for(*_max_vram_mb)), max_vram_mb(_max_vram_mb), used(_used)
+    {
+        block_size = block_size_for(*_max_vram_mb);
+    }
 
-    // each tile 100x100
-    const int xtiles = (width + TILE_SIZE_X - 1) / TILE_SIZE_X;
-    const int ytiles = (height + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+    virtual ~BudgetBlobAllocator()
+    {
+        clear();
+    }
 
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+    using ncnn::VkBlobAllocator::fastMalloc;
+    using ncnn::VkBlobAllocator::fastFree;
 
-    //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi < ytiles; yi++)
+    virtual void clear()
     {
-        const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, height) - yi * TILE_SIZE_Y;
+        ncnn::VkBlobAllocator::clear();
 
-        int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
-        int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding, height);
-        const int in_tile_w = width;
-        const int in_tile_h = in_tile_y1 - in_tile_y0;
-
-        ncnn::Mat in;
-        in.create(in_tile_w, in_tile_h, CHANNELS, sizeof(float));
-
-        float* in_tile_r = in.channel(0);
-        float* in_tile_g = in.channel(1);
-        float* in_tile_b = in.channel(2);
-        const float* sr = srcpR + in_tile_y0 * src_stride;
-        const float* sg = srcpG + in_tile_y0 * src_stride;
-        const float* sb = srcpB + in_tile_y0 * src_stride;
-        for (int y = 0; y < in_tile_h; y++)
+        size_t held = 0;
+        for (std::map<VkBuffer, size_t>::const_iterator it = blocks.begin(); it != blocks.end(); ++it)
+            held += it->second;
+        blocks.clear();
+
+        *used -= held;
+    }
+
+    virtual ncnn::VkBufferMemory* fastMalloc(size_t size)
+    {
+        // the base allocator may open a new block of at least block_size, reserve it up front
+        // sub-allocation offsets are aligned far below 4096, so this never undercounts the block
+        const size_t reserve = std::max(block_size, (size + 4095) & ~(size_t)4095);
+        if (!try_reserve(reserve))
+            return 0;
+
+        ncnn::VkBufferMemory* ptr = ncnn::VkBlobAllocator::fastMalloc(size);
+        if (!ptr || blocks.find(ptr->buffer) != blocks.end())
         {
-            for (int x = 0; x < in_tile_w; x++)
-            {
-                in_tile_r[in_tile_w * y + x] = sr[src_stride * y + x] * 255.f;
-                in_tile_g[in_tile_w * y + x] = sg[src_stride * y + x] * 255.f;
-                in_tile_b[in_tile_w * y + x] = sb[src_stride * y + x] * 255.f;
-            }
+            // failed, or carved from a block already charged
+            *used -= reserve;
+            return ptr;
         }
 
-        ncnn::VkCompute cmd(net.vulkan_device());
+        blocks[ptr->buffer] = reserve;
+        return ptr;
+    }
+
+private:
+    static size_t block_size_for(int max_vram_mb)
+    {
+        // keep blocks well under a small budget so one block does not eat it
+        const size_t preferred = 16 * 1024 * 1024;
+        return max_vram_mb > 0 ? std::min(preferred, std::max((size_t)max_vram_mb << 18, (size_t)1 << 20)) : preferred;
+    }
 
-        // upload
-        ncnn::VkMat in_gpu;
+    bool try_reserve(size_t bytes)
+    {
+        const size_t budget = (size_t)*max_vram_mb << 20;
+        size_t current = used->load();
+        do
         {
-            cmd.record_clone(in, in_gpu, opt);
+            if (budget > 0 && current + bytes > budget)
+                return false;
+        } while (!used->compare_exchange_weak(current, current + bytes));
 
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
-        }
+        return true;
+    }
 
-        int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
-        int out_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, height);
+    const int* max_vram_mb;
+    std::atomic<size_t>* used;
+    size_t block_size;
+    std::map<VkBuffer, size_t> blocks;
+};
 
-        ncnn::VkMat out_gpu;
-        out_gpu.create(width * scale, (out_tile_y1 - out_tile_y0) * scale, CHANNELS, sizeof(float), blob_vkallocator);
+// blob allocator shared by threads, cached tiles are allocated and freed by every tile row slot
+class SharedBlobAllocator : public BudgetBlobAllocator
+{
+public:
+    SharedBlobAllocator(const ncnn::VulkanDevice* _vkdev, const int* _max_vram_mb, std::atomic<size_t>* _used)
+        : BudgetBlobAllocator(_vkdev, _max_vram_mb, _used)
+    {
+    }
 
-        for (int xi = 0; xi < xtiles; xi++)
-        {
-            const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, width) - xi * TILE_SIZE_X;
+    using BudgetBlobAllocator::fastMalloc;
+    using BudgetBlobAllocator::fastFree;
 
-            if (tta_mode)
-            {
-                // preproc
-                ncnn::VkMat in_tile_gpu[8];
-                ncnn::VkMat in_alpha_tile_gpu;
-                {
-                    // crop tile
-                    int tile_x0 = xi * TILE_SIZE_X - prepadding;
-                    int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, width) + prepadding;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, height) + prepadding;
-
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
-
-                    std::vector<ncnn::VkMat> bindings(10);
-                    bindings[0] = in_gpu;
-                    bindings[1] = in_tile_gpu[0];
-                    bindings[2] = in_tile_gpu[1];
-                    bindings[3] = in_tile_gpu[2];
-                    bindings[4] = in_tile_gpu[3];
-                    bindings[5] = in_tile_gpu[4];
-                    bindings[6] = in_tile_gpu[5];
-                    bindings[7] = in_tile_gpu[6];
-                    bindings[8] = in_tile_gpu[7];
-                    bindings[9] = in_alpha_tile_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = in_tile_gpu[0].w;
-                    constants[4].i = in_tile_gpu[0].h;
-                    constants[5].i = in_tile_gpu[0].cstep;
-                    constants[6].i = prepadding;
-                    constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = CHANNELS;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu[0].w;
-                    dispatcher.h = in_tile_gpu[0].h;
-                    dispatcher.c = CHANNELS;
-
-                    cmd.record_pipeline(realesrgan_preproc, bindings, constants, dispatcher);
-                }
+    virtual void clear()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        BudgetBlobAllocator::clear();
+    }
 
-                // realesrgan
-                ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
-                {
-                    ncnn::Extractor ex = net.create_extractor();
+    virtual ncnn::VkBufferMemory* fastMalloc(size_t size)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return BudgetBlobAllocator::fastMalloc(size);
+    }
 
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+    virtual void fastFree(ncnn::VkBufferMemory* ptr)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        BudgetBlobAllocator::fastFree(ptr);
+    }
 
-                    ex.input("data", in_tile_gpu[ti]);
+private:
+    std::mutex lock;
+};
 
-                    ex.extract("output", out_tile_gpu[ti], cmd);
+// everything one process call allocates, kept for the next frame so steady state processing
+// only re-binds it, Mat and VkMat create return early while the shape is unchanged
+struct RealESRGAN::Workspace
+{
+    // gpu, one slot per tile row in flight, each with its own allocators
+    std::vector<TileRow> rows;
 
-                    {
-                        cmd.submit_and_wait();
-                        cmd.reset();
-                    }
-                }
+    // cpu
+    ncnn::PoolAllocator blob_allocator;
+    ncnn::PoolAllocator workspace_allocator;
+    ncnn::Mat in_tile[8];
+};
 
-                ncnn::VkMat out_alpha_tile_gpu;
+RealESRGAN::~RealESRGAN()
+{
+    for (Workspace* workspace : workspaces)
+    {
+        free_workspace(workspace);
+    }
+}
 
-                // postproc
-                {
-                    std::vector<ncnn::VkMat> bindings(10);
-                    bindings[0] = out_tile_gpu[0];
-                    bindings[1] = out_tile_gpu[1];
-                    bindings[2] = out_tile_gpu[2];
-                    bindings[3] = out_tile_gpu[3];
-                    bindings[4] = out_tile_gpu[4];
-                    bindings[5] = out_tile_gpu[5];
-                    bindings[6] = out_tile_gpu[6];
-                    bindings[7] = out_tile_gpu[7];
-                    bindings[8] = out_alpha_tile_gpu;
-                    bindings[9] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = out_tile_gpu[0].w;
-                    constants[1].i = out_tile_gpu[0].h;
-                    constants[2].i = out_tile_gpu[0].cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = prepadding * scale;
-                    constants[9].i = prepadding * scale;
-                    constants[10].i = CHANNELS;
-                    constants[11].i = out_alpha_tile_gpu.w;
-                    constants[12].i = out_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = CHANNELS;
-
-                    cmd.record_pipeline(realesrgan_postproc, bindings, constants, dispatcher);
-                }
-            }
-            else
-            {
-                // preproc
-                ncnn::VkMat in_tile_gpu;
-                ncnn::VkMat in_alpha_tile_gpu;
-                {
-                    // crop tile
-                    int tile_x0 = xi * TILE_SIZE_X - prepadding;
-                    int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, width) + prepadding;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, height) + prepadding;
-
-                    in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = in_gpu;
-                    bindings[1] = in_tile_gpu;
-                    bindings[2] = in_alpha_tile_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = in_tile_gpu.w;
-                    constants[4].i = in_tile_gpu.h;
-                    constants[5].i = in_tile_gpu.cstep;
-                    constants[6].i = prepadding;
-                    constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = CHANNELS;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu.w;
-                    dispatcher.h = in_tile_gpu.h;
-                    dispatcher.c = CHANNELS;
-
-                    cmd.record_pipeline(realesrgan_preproc, bindings, constants, dispatcher);
-                }
+void RealESRGAN::free_workspace(Workspace* workspace) const
+{
+    for (TileRow& row : workspace->rows)
+    {
+        // buffers go back to the allocators before these are reclaimed
+        row.in.release();
+        row.out.release();
+        row.in_gpu.release();
+        row.out_gpu.release();
+        for (int ti = 0; ti < 8; ti++)
+            row.in_tile_gpu[ti].release();
+        row.tile_output.clear();
+        row.cmd.reset();
+
+        model->net.vulkan_device()->reclaim_staging_allocator(row.opt.staging_vkallocator);
+    }
 
-                // realesrgan
-                ncnn::VkMat out_tile_gpu;
-                {
-                    ncnn::Extractor ex = net.create_extractor();
+    for (int ti = 0; ti < 8; ti++)
+        workspace->in_tile[ti].release();
 
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+    delete workspace;
+}
 
-                    ex.input("data", in_tile_gpu);
+// one workspace per concurrent process call
+RealESRGAN::Workspace* RealESRGAN::acquire_workspace() const
+{
+    std::unique_lock<std::mutex> guard(workspace_lock);
 
-                    ex.extract("output", out_tile_gpu, cmd);
-                }
+    // more workspaces than the scheduler can keep busy would only pin device memory
+    const size_t max_workspaces = scheduler ? (size_t)(scheduler->threads() + scheduler->queue_capacity()) : 0;
 
-                 ncnn::VkMat out_alpha_tile_gpu;
+    workspace_freed.wait(guard, [&]() {
+        return !free_workspaces.empty() || max_workspaces == 0 || workspaces.size() < max_workspaces;
+    });
 
-                // postproc
-                {
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = out_tile_gpu;
-                    bindings[1] = out_alpha_tile_gpu;
-                    bindings[2] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = out_tile_gpu.w;
-                    constants[1].i = out_tile_gpu.h;
-                    constants[2].i = out_tile_gpu.cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = prepadding * scale;
-                    constants[9].i = prepadding * scale;
-                    constants[10].i = CHANNELS;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = CHANNELS;
-
-                    cmd.record_pipeline(realesrgan_postproc, bindings, constants, dispatcher);
-                }
-            }
+    if (!free_workspaces.empty())
+    {
+        Workspace* workspace = free_workspaces.back();
+        free_workspaces.pop_back();
+        return workspace;
+    }
 
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
-        }
+    workspaces.push_back(new Workspace);
+    return workspaces.back();
+}
+
+void RealESRGAN::release_workspace(Workspace* workspace) const
+{
+    {
+        std::lock_guard<std::mutex> guard(workspace_lock);
+
+        free_workspaces.push_back(workspace);
+    }
+
+    workspace_freed.notify_one();
+}
+
+// shader sample type of the frame planes, see realesrgan_preproc.comp
+int RealESRGAN::sample_type() const
+{
+    if (float_sample)
+        return bits_per_sample == 16 ? 3 : 0;
+
+    return bits_per_sample == 8 ? 1 : 2;
+}
+
+int RealESRGAN::bytes_per_sample() const
+{
+    return bits_per_sample == 8 ? 1 : bits_per_sample <= 16 ? 2 : 4;
+}
+
+// shader sample type of the downloaded tile rows, see realesrgan_postproc.comp
+int RealESRGAN::out_sample_type() const
+{
+    if (half_download && float_sample && bits_per_sample == 32)
+        return 3;
+
+    return sample_type();
+}
+
+int RealESRGAN::out_bytes_per_sample() const
+{
+    return out_sample_type() == 3 ? 2 : bytes_per_sample();
+}
+
+// full scale white of the frame planes
+float RealESRGAN::sample_max() const
+{
+    return float_sample ? 1.f : (float)((1 << bits_per_sample) - 1);
+}
+
+// maps normalized values to frame samples, sample = value * scale + offset
+void RealESRGAN::sample_range(float& y_scale, float& y_offset, float& c_scale, float& c_offset) const
+{
+    if (float_sample)
+    {
+        y_scale = 1.f;
+        y_offset = 0.f;
+        c_scale = 1.f;
+        c_offset = 0.f;
+    }
+    else if (!yuv || full_range)
+    {
+        y_scale = sample_max();
+        y_offset = 0.f;
+        c_scale = sample_max();
+        c_offset = yuv ? (float)(1 << (bits_per_sample - 1)) : 0.f;
+    }
+    else
+    {
+        const int shift = bits_per_sample - 8;
+
+        y_scale = (float)(219 << shift);
+        y_offset = (float)(16 << shift);
+        c_scale = (float)(224 << shift);
+        c_offset = (float)(128 << shift);
+    }
+}
+
+static void matrix_coefficients(int matrix, float& kr, float& kb)
+{
+    switch (matrix)
+    {
+    case 4: // fcc
+        kr = 0.30f;
+        kb = 0.11f;
+        break;
+    case 5: // bt470bg
+    case 6: // smpte170m
+        kr = 0.299f;
+        kb = 0.114f;
+        break;
+    case 7: // smpte240m
+        kr = 0.212f;
+        kb = 0.087f;
+        break;
+    case 9: // bt2020nc
+        kr = 0.2627f;
+        kb = 0.0593f;
+        break;
+    case 1: // bt709
+    default:
+        kr = 0.2126f;
+        kb = 0.0722f;
+        break;
+    }
+}
+
+// tiles start on a word boundary of the packed output samples and on a chroma sample,
+// a tile covering the whole width or height needs no alignment
+// tilesize and tilesize_y, lowered by shrink_tiles after the device ran out of memory
+int RealESRGAN::tile_size_x(int width) const
+{
+    const int align = 4 << chroma_ssw;
+    const int size = tile_limit_x > 0 ? std::min(tilesize, tile_limit_x) : tilesize;
+
+    if (size >= width)
+        return width;
+
+    return std::max(size / align * align, align);
+}
+
+int RealESRGAN::tile_size_y(int height) const
+{
+    const int size = tile_limit_y > 0 ? std::min(tilesize_y, tile_limit_y) : tilesize_y;
+
+    if (size >= height)
+        return height;
+
+    return std::max(size >> chroma_ssh << chroma_ssh, 1 << chroma_ssh);
+}
+
+int RealESRGAN::output_width(int width) const
+{
+    return out_width > 0 ? out_width : width * scale;
+}
+
+int RealESRGAN::output_height(int height) const
+{
+    return out_height > 0 ? out_height : height * scale;
+}
+
+// first output pixel of the tile starting at input pixel i, aligned down to align. output pixel x is
+// centered on network output pixel (x + 0.5) * size * scale / out_size - 0.5
+static int output_start(int i, int scale, int size, int out_size, int align)
+{
+    if (i <= 0)
+        return 0;
+    if (i >= size)
+        return out_size;
+
+    const long long m = (long long)i * scale;
+    const long long model_size = (long long)size * scale;
+    const int x = (int)((2 * m * out_size + model_size - 1) / (2 * model_size));
+
+    return std::min(x / align * align, out_size);
+}
+
+// output columns of tile xi start at out_tile_x(xi), rows of tile row yi at out_tile_y(yi)
+int RealESRGAN::out_tile_x(int xi, int width) const
+{
+    return output_start(xi * tile_size_x(width), scale, width, output_width(width), 4 << chroma_ssw);
+}
+
+int RealESRGAN::out_tile_y(int yi, int height) const
+{
+    return output_start(yi * tile_size_y(height), scale, height, output_height(height), 1 << chroma_ssh);
+}
+
+// output pixel x, y of a tile samples its padded network output at x * step_x + origin_x, y * step_y + origin_y
+void RealESRGAN::resize_params(int xi, int yi, int width, int height, float& step_x, float& step_y, float& origin_x, float& origin_y) const
+{
+    step_x = (float)(width * scale) / (float)output_width(width);
+    step_y = (float)(height * scale) / (float)output_height(height);
+    origin_x = ((float)out_tile_x(xi, width) + 0.5f) * step_x - 0.5f - (float)((xi * tile_size_x(width) - prepadding) * scale);
+    origin_y = ((float)out_tile_y(yi, height) + 0.5f) * step_y - 0.5f - (float)((yi * tile_size_y(height) - prepadding) * scale);
+}
+
+// the postproc parameters following format_constants, see realesrgan_postproc.comp
+void RealESRGAN::resize_constants(std::vector<ncnn::vk_constant_type>& constants, int xi, int yi, int width, int height) const
+{
+    float step_x, step_y, origin_x, origin_y;
+    resize_params(xi, yi, width, height, step_x, step_y, origin_x, origin_y);
+
+    constants[25].i = output_width(width) != width * scale || output_height(height) != height * scale ? 1 : 0;
+    constants[26].f = step_x;
+    constants[27].f = step_y;
+    constants[28].f = origin_x;
+    constants[29].f = origin_y;
+}
+
+// the tile row output holds the luma or r plane followed by the two other planes,
+// each row packed into 32 bit words, see realesrgan_postproc.comp
+int RealESRGAN::out_plane_stride(int out_w, int c) const
+{
+    const int samples_per_word = 4 / out_bytes_per_sample();
+    const int plane_w = c > 0 ? out_w >> chroma_ssw : out_w;
+
+    return (plane_w + samples_per_word - 1) / samples_per_word;
+}
+
+int RealESRGAN::out_plane_offset(int out_w, int out_h, int c) const
+{
+    if (c == 0)
+        return 0;
+
+    return out_plane_stride(out_w, 0) * out_h + (c - 1) * out_plane_stride(out_w, 1) * (out_h >> chroma_ssh);
+}
+
+// the shader parameters following the tile geometry, see realesrgan_preproc.comp and realesrgan_postproc.comp
+void RealESRGAN::format_constants(std::vector<ncnn::vk_constant_type>& constants, bool postproc, int out_w) const
+{
+    float kr, kb;
+    matrix_coefficients(matrix, kr, kb);
+
+    float y_scale, y_offset, c_scale, c_offset;
+    sample_range(y_scale, y_offset, c_scale, c_offset);
+
+    constants[13].i = postproc ? out_sample_type() : sample_type();
+    constants[14].i = yuv ? 1 : 0;
+    constants[15].i = chroma_ssw;
+    constants[16].i = chroma_ssh;
+    constants[17].f = kr;
+    constants[18].f = kb;
 
-        // download
+    if (postproc)
+    {
+        constants[19].f = y_scale;
+        constants[20].f = y_offset;
+        constants[21].f = c_scale;
+        constants[22].f = c_offset;
+        constants[23].f = sample_max();
+        constants[24].i = out_plane_stride(out_w, 1);
+    }
+    else
+    {
+        constants[19].f = 1.f / y_scale;
+        constants[20].f = -y_offset / y_scale;
+        constants[21].f = 1.f / c_scale;
+        constants[22].f = -c_offset / c_scale;
+    }
+}
+
+// samples of every format are normalized and clamped by the shaders, so packing and unpacking
+// tile rows are plain row copies
+void RealESRGAN::pack_tile_row(const uint8_t* const* srcp, const int* src_stride, int in_tile_y0, ncnn::VkMat& in) const
+{
+    for (int c = 0; c < CHANNELS; c++)
+    {
+        // chroma rows are stored with their own width at the start of the channel
+        const int plane_w = c > 0 ? in.w >> chroma_ssw : in.w;
+        const int plane_h = c > 0 ? in.h >> chroma_ssh : in.h;
+        const size_t row_size = plane_w * in.elemsize;
+
+        const uint8_t* s = srcp[c] + (c > 0 ? in_tile_y0 >> chroma_ssh : in_tile_y0) * src_stride[c];
+        uint8_t* in_tile = (uint8_t*)in.mapped_ptr() + in.cstep * in.elemsize * c;
+
+        for (int y = 0; y < plane_h; y++)
         {
-            ncnn::Mat out;
+            memcpy(in_tile + row_size * y, s + src_stride[c] * y, row_size);
+        }
+    }
+
+    in.allocator->flush(in.data);
+}
+
+// widens n fp16 samples, with f16c or neon where available
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#if defined(__GNUC__)
+__attribute__((target("f16c")))
+#endif
+static void half_to_float_f16c(const uint16_t* src, float* dst, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+    }
+    for (; i < n; i++)
+    {
+        dst[i] = ncnn::float16_to_float32(src[i]);
+    }
+}
+#endif
 
-            cmd.record_clone(out_gpu, out, opt);
+static void half_to_float(const uint16_t* src, float* dst, int n)
+{
+    int i = 0;
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    static const bool f16c = ncnn::cpu_support_x86_f16c();
+    if (f16c)
+    {
+        half_to_float_f16c(src, dst, n);
+        return;
+    }
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    for (; i + 4 <= n; i += 4)
+    {
+        vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        dst[i] = ncnn::float16_to_float32(src[i]);
+    }
+}
 
-            cmd.submit_and_wait();
+void RealESRGAN::unpack_tile_row(const ncnn::VkMat& out, uint8_t* const* dstp, const int* dst_stride, int out_w, int out_h, int out_tile_y0) const
+{
+    out.allocator->invalidate(out.data);
 
-            if (!(opt.use_fp16_storage && opt.use_int8_storage))
-            {
-                const float* out_tile_r = out.channel(0);
-                const float* out_tile_g = out.channel(1);
-                const float* out_tile_b = out.channel(2);
+    for (int c = 0; c < CHANNELS; c++)
+    {
+        const int plane_w = c > 0 ? out_w >> chroma_ssw : out_w;
+        const int plane_h = c > 0 ? out_h >> chroma_ssh : out_h;
+        const size_t row_size = plane_w * bytes_per_sample();
+        const size_t out_row_size = out_plane_stride(out_w, c) * sizeof(uint32_t);
 
-                float* dr = dstpR + yi * TILE_SIZE_Y * scale * dst_stride;
-                float* dg = dstpG + yi * TILE_SIZE_Y * scale * dst_stride;
-                float* db = dstpB + yi * TILE_SIZE_Y * scale * dst_stride;
+        const uint8_t* out_tile = (const uint8_t*)out.mapped_ptr() + out_plane_offset(out_w, out_h, c) * sizeof(uint32_t);
+        uint8_t* d = dstp[c] + (c > 0 ? out_tile_y0 >> chroma_ssh : out_tile_y0) * dst_stride[c];
 
-                for (int y = 0; y < out.h; y++)
-                {
-                    for (int x = 0; x < out.w; x++)
-                    {
-                        dr[dst_stride * y + x] = std::min(1.f, std::max(0.f, out_tile_r[out.w * y + x] / 255.f));
-                        dg[dst_stride * y + x] = std::min(1.f, std::max(0.f, out_tile_g[out.w * y + x] / 255.f));
-                        db[dst_stride * y + x] = std::min(1.f, std::max(0.f, out_tile_b[out.w * y + x] / 255.f));
-                    }
-                }
-            }
+        for (int y = 0; y < plane_h; y++)
+        {
+            if (out_sample_type() != sample_type())
+                half_to_float((const uint16_t*)(out_tile + out_row_size * y), (float*)(d + dst_stride[c] * y), plane_w);
+            else
+                memcpy(d + dst_stride[c] * y, out_tile + out_row_size * y, row_size);
         }
     }
+}
+
+// stage timing of one tile row command buffer, a no-op without stage times
+class StageTimer
+{
+public:
+#if NCNN_BENCHMARK
+    StageTimer(ncnn::VkCompute& _cmd, const ncnn::VulkanDevice* _vkdev, RealESRGANStageTimes* _times) : cmd(_cmd), vkdev(_vkdev), times(_times)
+#else
+    StageTimer(ncnn::VkCompute& _cmd, RealESRGANStageTimes* _times) : cmd(_cmd), times(_times)
+#endif
+    {
+        if (!times)
+            return;
 
-    net.vulkan_device()->reclaim_blob_allocator(blob_vkallocator);
-    net.vulkan_device()->reclaim_staging_allocator(staging_vkallocator);
+#if NCNN_BENCHMARK
+        cmd.create_query_pool(max_marks + 1);
+        cmd.record_write_timestamp(0);
+#endif
+        start = std::chrono::steady_clock::now();
+    }
+
+    // called after recording a stage
+    void mark(RealESRGANStageTimes::Stage stage)
+    {
+        if (!times)
+            return;
+
+#if NCNN_BENCHMARK
+        stages.push_back(stage);
+        cmd.record_write_timestamp((uint32_t)stages.size());
+#else
+        // without timestamp queries every stage is waited for on its own
+        cmd.submit_and_wait();
+        cmd.reset();
+
+        const auto end = std::chrono::steady_clock::now();
+        times->add(stage, std::chrono::duration<double, std::milli>(end - start).count());
+        start = end;
+#endif
+    }
+
+    int submit_and_wait()
+    {
+        int ret = cmd.submit_and_wait();
+
+#if NCNN_BENCHMARK
+        if (times && !stages.empty())
+        {
+            std::vector<uint64_t> results;
+            cmd.get_query_pool_results(0, (uint32_t)stages.size() + 1, results);
+
+            const double ms_per_tick = vkdev->info.timestamp_period() / 1000000.0;
+            for (size_t i = 0; i < stages.size(); i++)
+                times->add(stages[i], (double)(results[i + 1] - results[i]) * ms_per_tick);
+
+            stages.clear();
+        }
+#endif
+
+        return ret;
+    }
+
+    void reset()
+    {
+        cmd.reset();
+
+#if NCNN_BENCHMARK
+        if (times)
+            cmd.record_write_timestamp(0);
+#endif
+    }
+
+private:
+    // upload, then per tile preproc, eight tta extractor runs and postproc, then download
+    static const int max_marks = 16;
+
+    ncnn::VkCompute& cmd;
+#if NCNN_BENCHMARK
+    // timestamp period of the device
+    const ncnn::VulkanDevice* vkdev;
+#endif
+    RealESRGANStageTimes* times;
+    std::vector<RealESRGANStageTimes::Stage> stages;
+    std::chrono::steady_clock::time_point start;
+};
+
+int RealESRGAN::process_tile_row(TileRow& row, int width, int height, RealESRGANStageTimes* stage_times) const
+{
+    const int yi = row.yi;
+    const ncnn::Option& opt = row.opt;
+
+    const int TILE_SIZE_X = tile_size_x(width);
+    const int TILE_SIZE_Y = tile_size_y(height);
+
+    ncnn::VkAllocator* blob_vkallocator = opt.blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator = opt.staging_vkallocator;
+
+    const int xtiles = (width + TILE_SIZE_X - 1) / TILE_SIZE_X;
+
+    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+
+    // network outputs of missed tiles are copied into the tile cache allocator
+    const bool skipping = !row.tile_hit.empty();
+    ncnn::Option opt_cache = opt;
+    opt_cache.blob_vkallocator = tile_cache_allocator.get();
+
+    // the slot command buffer is reset and recorded again, ncnn has no way to replay it.
+    // timing records into a fresh one as it owns its query pool
+    std::unique_ptr<ncnn::VkCompute> timed_cmd;
+    if (stage_times)
+        timed_cmd.reset(new ncnn::VkCompute(model->net.vulkan_device()));
+    else if (row.cmd)
+        row.cmd->reset();
+    else
+        row.cmd.reset(new ncnn::VkCompute(model->net.vulkan_device()));
+
+    ncnn::VkCompute& cmd = stage_times ? *timed_cmd : *row.cmd;
+
+#if NCNN_BENCHMARK
+    StageTimer timer(cmd, model->net.vulkan_device(), stage_times);
+#else
+    StageTimer timer(cmd, stage_times);
+#endif
+
+    // upload, the tile row is already in staging memory
+    ncnn::VkMat& in_gpu = row.in_gpu;
+    {
+        cmd.record_clone(row.in, in_gpu, opt);
+        if (in_gpu.empty())
+            return -100;
+        timer.mark(RealESRGANStageTimes::Upload);
+
+        if (xtiles > 1)
+        {
+            timer.submit_and_wait();
+            timer.reset();
+        }
+    }
+
+    const int out_w = output_width(width);
+    const int out_h = out_tile_y(yi + 1, height) - out_tile_y(yi, height);
+    const int samples_per_word = 4 / out_bytes_per_sample();
+
+    // output planes, samples packed into 32 bit words
+    ncnn::VkMat& out_gpu = row.out_gpu;
+    out_gpu.create(out_plane_offset(out_w, out_h, CHANNELS), 1, 1, sizeof(uint32_t), blob_vkallocator);
+    if (out_gpu.empty())
+        return -100;
+
+    for (int xi = 0; xi < xtiles; xi++)
+    {
+        const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, width) - xi * TILE_SIZE_X;
+
+        // a cached tile goes straight to postproc
+        const bool hit = skipping && row.tile_hit[xi];
+
+        if (model->tta_mode)
+        {
+            // preproc
+            ncnn::VkMat* in_tile_gpu = row.in_tile_gpu;
+            ncnn::VkMat in_alpha_tile_gpu;
+            if (!hit)
+            {
+                // crop tile
+                int tile_x0 = xi * TILE_SIZE_X - prepadding;
+                int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, width) + prepadding;
+                int tile_y0 = yi * TILE_SIZE_Y - prepadding;
+                int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, height) + prepadding;
+
+                in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
+                in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
+                in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
+                in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
+                in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
+                in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
+                in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
+                in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, CHANNELS, in_out_tile_elemsize, 1, blob_vkallocator);
+                for (int ti = 0; ti < 8; ti++)
+                {
+                    if (in_tile_gpu[ti].empty())
+                        return -100;
+                }
+
+                std::vector<ncnn::VkMat> bindings(10);
+                bindings[0] = in_gpu;
+                bindings[1] = in_tile_gpu[0];
+                bindings[2] = in_tile_gpu[1];
+                bindings[3] = in_tile_gpu[2];
+                bindings[4] = in_tile_gpu[3];
+                bindings[5] = in_tile_gpu[4];
+                bindings[6] = in_tile_gpu[5];
+                bindings[7] = in_tile_gpu[6];
+                bindings[8] = in_tile_gpu[7];
+                bindings[9] = in_alpha_tile_gpu;
+
+                std::vector<ncnn::vk_constant_type> constants(23);
+                constants[0].i = in_gpu.w;
+                constants[1].i = in_gpu.h;
+                constants[2].i = in_gpu.cstep;
+                constants[3].i = in_tile_gpu[0].w;
+                constants[4].i = in_tile_gpu[0].h;
+                constants[5].i = in_tile_gpu[0].cstep;
+                constants[6].i = prepadding;
+                constants[7].i = prepadding;
+                constants[8].i = xi * TILE_SIZE_X;
+                constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
+                constants[10].i = CHANNELS;
+                constants[11].i = in_alpha_tile_gpu.w;
+                constants[12].i = in_alpha_tile_gpu.h;
+                format_constants(constants, false, out_w);
+
+                ncnn::VkMat dispatcher;
+                dispatcher.w = in_tile_gpu[0].w;
+                dispatcher.h = in_tile_gpu[0].h;
+                dispatcher.c = CHANNELS;
+
+                cmd.record_pipeline(model->realesrgan_preproc, bindings, constants, dispatcher);
+                timer.mark(RealESRGANStageTimes::Preproc);
+            }
+
+            // realesrgan
+            // all eight transforms go into the same command buffer and the tile is synced once,
+            // intermediate blobs of one pass are recycled by the blob allocator for the next
+            ncnn::VkMat out_tile_gpu[8];
+            for (int ti = 0; ti < 8; ti++)
+            {
+                if (hit)
+                {
+                    out_tile_gpu[ti] = row.tile_output[xi * 8 + ti];
+                    continue;
+                }
+
+                ncnn::Extractor ex = model->net.create_extractor();
+
+                ex.set_blob_vkallocator(blob_vkallocator);
+                ex.set_workspace_vkallocator(blob_vkallocator);
+                ex.set_staging_vkallocator(staging_vkallocator);
+
+                ex.input(model->input_name.c_str(), in_tile_gpu[ti]);
+
+                int ret = ex.extract(model->output_name.c_str(), out_tile_gpu[ti], cmd);
+                if (ret != 0)
+                    return ret;
+                timer.mark(RealESRGANStageTimes::Inference);
+
+                if (skipping)
+                    cmd.record_clone(out_tile_gpu[ti], row.tile_output[xi * 8 + ti], opt_cache);
+            }
+
+            ncnn::VkMat out_alpha_tile_gpu;
+
+            // postproc
+            {
+                std::vector<ncnn::VkMat> bindings(10);
+                bindings[0] = out_tile_gpu[0];
+                bindings[1] = out_tile_gpu[1];
+                bindings[2] = out_tile_gpu[2];
+                bindings[3] = out_tile_gpu[3];
+                bindings[4] = out_tile_gpu[4];
+                bindings[5] = out_tile_gpu[5];
+                bindings[6] = out_tile_gpu[6];
+                bindings[7] = out_tile_gpu[7];
+                bindings[8] = out_alpha_tile_gpu;
+                bindings[9] = out_gpu;
+
+                std::vector<ncnn::vk_constant_type> constants(30);
+                constants[0].i = out_tile_gpu[0].w;
+                constants[1].i = out_tile_gpu[0].h;
+                constants[2].i = out_tile_gpu[0].cstep;
+                constants[3].i = out_plane_stride(out_w, 0);
+                constants[4].i = out_h;
+                constants[5].i = out_plane_offset(out_w, out_h, 1);
+                constants[6].i = out_tile_x(xi, width);
+                constants[7].i = out_tile_x(xi + 1, width) - out_tile_x(xi, width);
+                constants[8].i = prepadding * scale;
+                constants[9].i = prepadding * scale;
+                constants[10].i = CHANNELS;
+                constants[11].i = out_alpha_tile_gpu.w;
+                constants[12].i = out_alpha_tile_gpu.h;
+                format_constants(constants, true, out_w);
+                resize_constants(constants, xi, yi, width, height);
+
+                ncnn::VkMat dispatcher;
+                dispatcher.w = (constants[7].i + samples_per_word - 1) / samples_per_word;
+                dispatcher.h = out_h;
+                dispatcher.c = CHANNELS;
+
+                cmd.record_pipeline(model->realesrgan_postproc, bindings, constants, dispatcher);
+                timer.mark(RealESRGANStageTimes::Postproc);
+            }
+        }
+        else
+        {
+            // preproc
+            ncnn::VkMat& in_tile_gpu = row.in_tile_gpu[0];
+            ncnn::VkMat in_alpha_tile_gpu;
+            if (!hit)
+            {
+                // crop tile
+                int tile_x0 = xi * TILE_SIZE_X - prepadding;
+                int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, width) + prepadding;
+                int tile_y0 = yi * TILE_SIZE_Y - prepadding;
+                int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, height) + prepadding;
+
+                in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                if (in_tile_gpu.empty())
+                    return -100;
+
+                std::vector<ncnn::VkMat> bindings(3);
+                bindings[0] = in_gpu;
+                bindings[1] = in_tile_gpu;
+                bindings[2] = in_alpha_tile_gpu;
+
+                std::vector<ncnn::vk_constant_type> constants(23);
+                constants[0].i = in_gpu.w;
+                constants[1].i = in_gpu.h;
+                constants[2].i = in_gpu.cstep;
+                constants[3].i = in_tile_gpu.w;
+                constants[4].i = in_tile_gpu.h;
+                constants[5].i = in_tile_gpu.cstep;
+                constants[6].i = prepadding;
+                constants[7].i = prepadding;
+                constants[8].i = xi * TILE_SIZE_X;
+                constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
+                constants[10].i = CHANNELS;
+                constants[11].i = in_alpha_tile_gpu.w;
+                constants[12].i = in_alpha_tile_gpu.h;
+                format_constants(constants, false, out_w);
+
+                ncnn::VkMat dispatcher;
+                dispatcher.w = in_tile_gpu.w;
+                dispatcher.h = in_tile_gpu.h;
+                dispatcher.c = CHANNELS;
+
+                cmd.record_pipeline(model->realesrgan_preproc, bindings, constants, dispatcher);
+                timer.mark(RealESRGANStageTimes::Preproc);
+            }
+
+            // realesrgan
+            ncnn::VkMat out_tile_gpu;
+            if (hit)
+            {
+                out_tile_gpu = row.tile_output[xi * 8];
+            }
+            else
+            {
+                ncnn::Extractor ex = model->net.create_extractor();
+
+                ex.set_blob_vkallocator(blob_vkallocator);
+                ex.set_workspace_vkallocator(blob_vkallocator);
+                ex.set_staging_vkallocator(staging_vkallocator);
+
+                ex.input(model->input_name.c_str(), in_tile_gpu);
+
+                int ret = ex.extract(model->output_name.c_str(), out_tile_gpu, cmd);
+                if (ret != 0)
+                    return ret;
+                timer.mark(RealESRGANStageTimes::Inference);
+
+                if (skipping)
+                    cmd.record_clone(out_tile_gpu, row.tile_output[xi * 8], opt_cache);
+            }
+
+             ncnn::VkMat out_alpha_tile_gpu;
+
+            // postproc
+            {
+                std::vector<ncnn::VkMat> bindings(3);
+                bindings[0] = out_tile_gpu;
+                bindings[1] = out_alpha_tile_gpu;
+                bindings[2] = out_gpu;
+
+                std::vector<ncnn::vk_constant_type> constants(30);
+                constants[0].i = out_tile_gpu.w;
+                constants[1].i = out_tile_gpu.h;
+                constants[2].i = out_tile_gpu.cstep;
+                constants[3].i = out_plane_stride(out_w, 0);
+                constants[4].i = out_h;
+                constants[5].i = out_plane_offset(out_w, out_h, 1);
+                constants[6].i = out_tile_x(xi, width);
+                constants[7].i = out_tile_x(xi + 1, width) - out_tile_x(xi, width);
+                constants[8].i = prepadding * scale;
+                constants[9].i = prepadding * scale;
+                constants[10].i = CHANNELS;
+                constants[11].i = in_alpha_tile_gpu.w;
+                constants[12].i = in_alpha_tile_gpu.h;
+                format_constants(constants, true, out_w);
+                resize_constants(constants, xi, yi, width, height);
+
+                ncnn::VkMat dispatcher;
+                dispatcher.w = (constants[7].i + samples_per_word - 1) / samples_per_word;
+                dispatcher.h = out_h;
+                dispatcher.c = CHANNELS;
+
+                cmd.record_pipeline(model->realesrgan_postproc, bindings, constants, dispatcher);
+                timer.mark(RealESRGANStageTimes::Postproc);
+            }
+        }
+
+        if (xtiles > 1)
+        {
+            timer.submit_and_wait();
+            timer.reset();
+        }
+    }
+
+    // download into staging memory, unpacked from there straight into the frame
+    {
+        ncnn::Option opt_staging = opt;
+        opt_staging.blob_vkallocator = opt.staging_vkallocator;
+
+        cmd.record_clone(out_gpu, row.out, opt_staging);
+        if (row.out.empty())
+            return -100;
+
+        timer.mark(RealESRGANStageTimes::Download);
+
+        int ret = timer.submit_and_wait();
+
+        if (ret == 0 && skipping)
+            store_tiles(row, width, height);
+
+        return ret;
+    }
+}
+
+int RealESRGAN::process(const uint8_t* const* srcp, uint8_t* const* dstp, int width, int height, const int* src_stride, const int* dst_stride, RealESRGANStageTimes* stage_times, bool* shrunk) const
+{
+    for (;;)
+    {
+        int ret;
+        int tile_x;
+        int tile_y;
+        {
+            std::shared_lock<std::shared_mutex> guard(shrink_lock);
+
+            tile_x = tile_size_x(width);
+            tile_y = tile_size_y(height);
+
+            Workspace* workspace = acquire_workspace();
+
+            if (model->net.opt.use_vulkan_compute)
+                ret = process_gpu(*workspace, srcp, dstp, width, height, src_stride, dst_stride, stage_times);
+            else
+                ret = process_cpu(*workspace, srcp, dstp, width, height, src_stride, dst_stride, stage_times);
+
+            release_workspace(workspace);
+        }
+
+        // out of memory, the frame is processed again with smaller tiles
+        if (ret != -100 || !retry_smaller_tiles)
+            return ret;
+
+        const int shrink = shrink_tiles(width, height, tile_x, tile_y);
+        if (shrink < 0)
+            return ret;
+
+        if (shrink > 0 && shrunk)
+            *shrunk = true;
+    }
+}
+
+void RealESRGAN::tile_size(int width, int height, int& tile_x, int& tile_y) const
+{
+    std::shared_lock<std::shared_mutex> guard(shrink_lock);
+
+    tile_x = tile_size_x(width);
+    tile_y = tile_size_y(height);
+}
+
+// halves the tiles after an allocation failure with tile_x x tile_y tiles and frees the buffers and cached
+// tiles of the old size. 1 when shrunk, 0 when another call already shrank them, -1 when they can't shrink further
+int RealESRGAN::shrink_tiles(int width, int height, int tile_x, int tile_y) const
+{
+    const int min_tilesize = 32;
+
+    std::unique_lock<std::shared_mutex> guard(shrink_lock);
+
+    if (tile_size_x(width) != tile_x || tile_size_y(height) != tile_y)
+        return 0;
+
+    if (tile_x <= min_tilesize && tile_y <= min_tilesize)
+        return -1;
+
+    tile_limit_x = std::max(tile_x / 2, min_tilesize);
+    tile_limit_y = std::max(tile_y / 2, min_tilesize);
+
+    free_buffers();
+
+    return 1;
+}
+
+void RealESRGAN::release_buffers() const
+{
+    std::unique_lock<std::shared_mutex> guard(shrink_lock);
+
+    free_buffers();
+}
+
+// called with shrink_lock held exclusively, so no process call is running and every workspace is free
+void RealESRGAN::free_buffers() const
+{
+    {
+        std::lock_guard<std::mutex> workspace_guard(workspace_lock);
+
+        for (Workspace* workspace : workspaces)
+            free_workspace(workspace);
+        workspaces.clear();
+        free_workspaces.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> tile_cache_guard(tile_cache_lock);
+
+        tile_cache.clear();
+        tile_cache_allocator.reset();
+    }
+}
+
+int RealESRGAN::process_gpu(Workspace& workspace, const uint8_t* const* srcp, uint8_t* const* dstp, int width, int height, const int* src_stride, const int* dst_stride, RealESRGANStageTimes* stage_times) const
+{
+    const int TILE_SIZE_Y = tile_size_y(height);
+
+    // each tile 100x100
+    const int ytiles = (height + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    // one slot per tile row in flight, each with its own allocators and staging buffers
+    const int slots = std::max(std::min(pipeline_depth, ytiles), 1);
+
+    // slots keep their allocators for the lifetime of the workspace
+    std::vector<TileRow>& rows = workspace.rows;
+    for (int si = (int)rows.size(); si < slots; si++)
+    {
+        rows.emplace_back();
+
+        rows[si].blob_allocator.reset(new BudgetBlobAllocator(model->net.vulkan_device(), &max_vram_mb, &vram_used));
+
+        ncnn::Option& opt = rows[si].opt;
+        opt = model->net.opt;
+        opt.blob_vkallocator = rows[si].blob_allocator.get();
+        opt.workspace_vkallocator = opt.blob_vkallocator;
+        opt.staging_vkallocator = model->net.vulkan_device()->acquire_staging_allocator();
+    }
+
+    int ret = 0;
+
+    // tile row N+1 is packed and tile row N-slots is unpacked while the rows in between run on the gpu
+    for (int yi = 0; yi < ytiles + slots; yi++)
+    {
+        if (yi >= slots)
+        {
+            TileRow& row = rows[(yi - slots) % slots];
+
+            if (row.pending.valid())
+                row.ret = row.pending.get();
+
+            // the first failure is the one reported
+            if (ret == 0)
+                ret = row.ret;
+
+            // failed rows have nothing to unpack
+            if (row.ret == 0)
+            {
+                const int out_tile_y0 = out_tile_y(row.yi, height);
+                const int out_tile_y1 = out_tile_y(row.yi + 1, height);
+
+                const auto unpack_start = std::chrono::steady_clock::now();
+                unpack_tile_row(row.out, dstp, dst_stride, output_width(width), out_tile_y1 - out_tile_y0, out_tile_y0);
+                if (stage_times)
+                    stage_times->add(RealESRGANStageTimes::Unpack, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - unpack_start).count());
+            }
+        }
+
+        if (yi >= ytiles)
+            continue;
+
+        TileRow& row = rows[yi % slots];
+        row.yi = yi;
+
+        // after a failure the rows in flight finish and no new ones start
+        if (ret != 0)
+        {
+            row.ret = ret;
+            continue;
+        }
+
+        int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
+        int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding, height);
+
+        row.in.create(width, in_tile_y1 - in_tile_y0, CHANNELS, (size_t)bytes_per_sample(), row.opt.staging_vkallocator);
+        if (row.in.empty())
+        {
+            row.ret = -100;
+            continue;
+        }
+
+        const auto pack_start = std::chrono::steady_clock::now();
+        pack_tile_row(srcp, src_stride, in_tile_y0, row.in);
+        if (skip_threshold >= 0.f)
+            lookup_tiles(row, srcp, src_stride, width, height);
+        if (stage_times)
+            stage_times->add(RealESRGANStageTimes::Pack, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pack_start).count());
+
+        if (scheduler)
+        {
+            row.pending = scheduler->submit([this, &row, width, height, stage_times]() {
+                return process_tile_row(row, width, height, stage_times);
+            });
+        }
+        else
+        {
+            row.ret = process_tile_row(row, width, height, stage_times);
+        }
+    }
+
+    return ret;
+}
+
+// cpu equivalents of the preproc and postproc shaders, see realesrgan_preproc.comp and realesrgan_postproc.comp
+static float load_sample(const uint8_t* row, int x, int sample_type)
+{
+    switch (sample_type)
+    {
+    case 1:
+        return (float)row[x];
+    case 2:
+        return (float)((const uint16_t*)row)[x];
+    case 3:
+        return ncnn::float16_to_float32(((const unsigned short*)row)[x]);
+    default:
+        return ((const float*)row)[x];
+    }
+}
+
+static void store_sample(uint8_t* row, int x, int sample_type, float v, bool chroma, float sample_max)
+{
+    if (sample_type == 0 || sample_type == 3)
+    {
+        v = chroma ? std::clamp(v, -0.5f, 0.5f) : std::clamp(v, 0.f, 1.f);
+
+        if (sample_type == 0)
+            ((float*)row)[x] = v;
+        else
+            ((unsigned short*)row)[x] = ncnn::float32_to_float16(v);
+        return;
+    }
+
+    const float u = std::clamp(std::floor(v + 0.5f), 0.f, sample_max);
+
+    if (sample_type == 1)
+        row[x] = (uint8_t)u;
+    else
+        ((uint16_t*)row)[x] = (uint16_t)u;
+}
+
+static int reflect(int x, int w)
+{
+    x = std::abs(x);
+    return (w - 1) - std::abs(x - (w - 1));
+}
+
+// position of pixel x, y of a w x h image in tta transform ti, transforms 4 to 7 are transposed,
+// see realesrgan_preproc_tta.comp
+static void tta_transform(int ti, int x, int y, int w, int h, int& tx, int& ty)
+{
+    switch (ti)
+    {
+    case 1: tx = w - 1 - x; ty = y; break;
+    case 2: tx = w - 1 - x; ty = h - 1 - y; break;
+    case 3: tx = x; ty = h - 1 - y; break;
+    case 4: tx = y; ty = x; break;
+    case 5: tx = h - 1 - y; ty = x; break;
+    case 6: tx = h - 1 - y; ty = w - 1 - x; break;
+    case 7: tx = y; ty = w - 1 - x; break;
+    default: tx = x; ty = y; break;
+    }
+}
+
+// samples of the tile input region, halo included, of every plane
+void RealESRGAN::gather_tile(const uint8_t* const* srcp, const int* src_stride, int width, int height, int x0, int x1, int y0, int y1, std::vector<uint8_t>& samples) const
+{
+    const int bps = bytes_per_sample();
+
+    samples.clear();
+
+    for (int c = 0; c < CHANNELS; c++)
+    {
+        int px0 = x0;
+        int px1 = x1;
+        int py0 = y0;
+        int py1 = y1;
+
+        if (yuv && c > 0)
+        {
+            // bilinear chroma upsampling reads one chroma sample around the region
+            px0 = std::max((x0 >> chroma_ssw) - 1, 0);
+            px1 = std::min(((x1 - 1) >> chroma_ssw) + 2, width >> chroma_ssw);
+            py0 = std::max((y0 >> chroma_ssh) - 1, 0);
+            py1 = std::min(((y1 - 1) >> chroma_ssh) + 2, height >> chroma_ssh);
+        }
+
+        for (int y = py0; y < py1; y++)
+        {
+            const uint8_t* s = srcp[c] + y * src_stride[c] + px0 * bps;
+            samples.insert(samples.end(), s, s + (px1 - px0) * bps);
+        }
+    }
+}
+
+bool RealESRGAN::same_tile(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) const
+{
+    if (a.size() != b.size())
+        return false;
+
+    if (skip_threshold <= 0.f)
+        return a == b;
+
+    const int type = sample_type();
+    const int bps = bytes_per_sample();
+    const float max_diff = skip_threshold * sample_max();
+
+    for (size_t i = 0; i < a.size(); i += bps)
+    {
+        if (std::fabs(load_sample(a.data() + i, 0, type) - load_sample(b.data() + i, 0, type)) > max_diff)
+            return false;
+    }
+
+    return true;
+}
+
+// finds the tiles of a packed row whose input matches the cached one
+void RealESRGAN::lookup_tiles(TileRow& row, const uint8_t* const* srcp, const int* src_stride, int width, int height) const
+{
+    const int TILE_SIZE_X = tile_size_x(width);
+    const int TILE_SIZE_Y = tile_size_y(height);
+
+    const int xtiles = (width + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (height + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    const int y0 = std::max(row.yi * TILE_SIZE_Y - prepadding, 0);
+    const int y1 = std::min((row.yi + 1) * TILE_SIZE_Y + prepadding, height);
+
+    row.tile_input.resize(xtiles);
+    row.tile_hit.assign(xtiles, 0);
+    row.tile_output.assign(xtiles * 8, ncnn::VkMat());
+
+    for (int xi = 0; xi < xtiles; xi++)
+    {
+        const int x0 = std::max(xi * TILE_SIZE_X - prepadding, 0);
+        const int x1 = std::min((xi + 1) * TILE_SIZE_X + prepadding, width);
+
+        gather_tile(srcp, src_stride, width, height, x0, x1, y0, y1, row.tile_input[xi]);
+    }
+
+    std::lock_guard<std::mutex> guard(tile_cache_lock);
+
+    if (!tile_cache_allocator)
+        tile_cache_allocator.reset(new SharedBlobAllocator(model->net.vulkan_device(), &max_vram_mb, &vram_used));
+
+    if ((int)tile_cache.size() != xtiles * ytiles)
+    {
+        tile_cache.clear();
+        tile_cache.resize(xtiles * ytiles);
+    }
+
+    for (int xi = 0; xi < xtiles; xi++)
+    {
+        const CachedTile& tile = tile_cache[row.yi * xtiles + xi];
+
+        const int x0 = std::max(xi * TILE_SIZE_X - prepadding, 0);
+        const int x1 = std::min((xi + 1) * TILE_SIZE_X + prepadding, width);
+
+        if (tile.output[0].empty() || tile.x0 != x0 || tile.x1 != x1 || tile.y0 != y0 || tile.y1 != y1)
+            continue;
+
+        if (!same_tile(tile.input, row.tile_input[xi]))
+            continue;
+
+        row.tile_hit[xi] = 1;
+        for (int ti = 0; ti < 8; ti++)
+            row.tile_output[xi * 8 + ti] = tile.output[ti];
+    }
+}
+
+// caches the network output of the missed tiles once the row completed
+void RealESRGAN::store_tiles(TileRow& row, int width, int height) const
+{
+    const int TILE_SIZE_X = tile_size_x(width);
+    const int TILE_SIZE_Y = tile_size_y(height);
+
+    const int xtiles = (width + TILE_SIZE_X - 1) / TILE_SIZE_X;
+
+    {
+        std::lock_guard<std::mutex> guard(tile_cache_lock);
+
+        for (int xi = 0; xi < xtiles; xi++)
+        {
+            const size_t index = row.yi * xtiles + xi;
+            if (row.tile_hit[xi] || index >= tile_cache.size())
+                continue;
+
+            CachedTile& tile = tile_cache[index];
+            tile.x0 = std::max(xi * TILE_SIZE_X - prepadding, 0);
+            tile.x1 = std::min((xi + 1) * TILE_SIZE_X + prepadding, width);
+            tile.y0 = std::max(row.yi * TILE_SIZE_Y - prepadding, 0);
+            tile.y1 = std::min((row.yi + 1) * TILE_SIZE_Y + prepadding, height);
+            tile.input.swap(row.tile_input[xi]);
+
+            for (int ti = 0; ti < 8; ti++)
+                tile.output[ti] = row.tile_output[xi * 8 + ti];
+        }
+    }
+
+    row.tile_output.assign(row.tile_output.size(), ncnn::VkMat());
+}
+
+int RealESRGAN::process_cpu(Workspace& workspace, const uint8_t* const* srcp, uint8_t* const* dstp, int width, int height, const int* src_stride, const int* dst_stride, RealESRGANStageTimes* stage_times) const
+{
+    const int TILE_SIZE_X = tile_size_x(width);
+    const int TILE_SIZE_Y = tile_size_y(height);
+
+    const int xtiles = (width + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (height + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    const int type = sample_type();
+    const float smax = sample_max();
+
+    float kr, kb;
+    matrix_coefficients(matrix, kr, kb);
+
+    float y_scale, y_offset, c_scale, c_offset;
+    sample_range(y_scale, y_offset, c_scale, c_offset);
+
+    const int cw = width >> chroma_ssw;
+    const int ch = height >> chroma_ssh;
+
+    auto load = [&](int c, int x, int y) {
+        return load_sample(srcp[c] + (size_t)y * src_stride[c], x, type);
+    };
+
+    // bilinear chroma, sited left horizontally and centered vertically
+    auto load_chroma = [&](int c, float cx, float cy) {
+        cx = std::clamp(cx, 0.f, (float)(cw - 1));
+        cy = std::clamp(cy, 0.f, (float)(ch - 1));
+
+        const int x0 = (int)cx;
+        const int y0 = (int)cy;
+        const int x1 = std::min(x0 + 1, cw - 1);
+        const int y1 = std::min(y0 + 1, ch - 1);
+        const float fx = cx - (float)x0;
+        const float fy = cy - (float)y0;
+
+        const float v0 = load(c, x0, y0) + (load(c, x1, y0) - load(c, x0, y0)) * fx;
+        const float v1 = load(c, x0, y1) + (load(c, x1, y1) - load(c, x0, y1)) * fx;
+
+        return v0 + (v1 - v0) * fy;
+    };
+
+    auto load_rgb = [&](int x, int y, float* rgb) {
+        if (!yuv)
+        {
+            for (int c = 0; c < CHANNELS; c++)
+                rgb[c] = load(c, x, y) / y_scale - y_offset / y_scale;
+            return;
+        }
+
+        const float cx = (float)x / (float)(1 << chroma_ssw);
+        const float cy = ((float)y + 0.5f) / (float)(1 << chroma_ssh) - 0.5f;
+
+        const float Y = load(0, x, y) / y_scale - y_offset / y_scale;
+        const float U = load_chroma(1, cx, cy) / c_scale - c_offset / c_scale;
+        const float V = load_chroma(2, cx, cy) / c_scale - c_offset / c_scale;
+
+        rgb[0] = Y + 2.f * (1.f - kr) * V;
+        rgb[2] = Y + 2.f * (1.f - kb) * U;
+        rgb[1] = (Y - kr * rgb[0] - kb * rgb[2]) / (1.f - kr - kb);
+    };
+
+    const int ntta = model->tta_mode ? 8 : 1;
+    const bool resizing = output_width(width) != width * scale || output_height(height) != height * scale;
+
+    for (int yi = 0; yi < ytiles; yi++)
+    {
+        for (int xi = 0; xi < xtiles; xi++)
+        {
+            // preproc
+            const int tile_x0 = xi * TILE_SIZE_X - prepadding;
+            const int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, width) + prepadding;
+            const int tile_y0 = yi * TILE_SIZE_Y - prepadding;
+            const int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, height) + prepadding;
+            const int in_w = tile_x1 - tile_x0;
+            const int in_h = tile_y1 - tile_y0;
+
+            auto stage_start = std::chrono::steady_clock::now();
+            auto stage_done = [&](RealESRGANStageTimes::Stage stage) {
+                if (!stage_times)
+                    return;
+
+                const auto stage_end = std::chrono::steady_clock::now();
+                stage_times->add(stage, std::chrono::duration<double, std::milli>(stage_end - stage_start).count());
+                stage_start = stage_end;
+            };
+
+            ncnn::Mat& in = workspace.in_tile[0];
+            in.create(in_w, in_h, CHANNELS, (size_t)4u, &workspace.blob_allocator);
+            if (in.empty())
+                return -100;
+            for (int y = 0; y < in_h; y++)
+            {
+                for (int x = 0; x < in_w; x++)
+                {
+                    float rgb[CHANNELS];
+                    load_rgb(reflect(tile_x0 + x, width), reflect(tile_y0 + y, height), rgb);
+
+                    for (int c = 0; c < CHANNELS; c++)
+                        in.channel(c).row(y)[x] = rgb[c];
+                }
+            }
+
+            stage_done(RealESRGANStageTimes::Preproc);
+
+            // realesrgan, tta runs the eight transforms of the tile and averages them back
+            ncnn::Mat out_tile[8];
+            for (int ti = 0; ti < ntta; ti++)
+            {
+                ncnn::Mat& in_tile = workspace.in_tile[ti];
+                if (ti > 0)
+                {
+                    in_tile.create(ti >= 4 ? in_h : in_w, ti >= 4 ? in_w : in_h, CHANNELS, (size_t)4u, &workspace.blob_allocator);
+                    if (in_tile.empty())
+                        return -100;
+                    for (int c = 0; c < CHANNELS; c++)
+                    {
+                        for (int y = 0; y < in_h; y++)
+                        {
+                            for (int x = 0; x < in_w; x++)
+                            {
+                                int tx, ty;
+                                tta_transform(ti, x, y, in_w, in_h, tx, ty);
+                                in_tile.channel(c).row(ty)[tx] = in.channel(c).row(y)[x];
+                            }
+                        }
+                    }
+                }
+
+                ncnn::Extractor ex = model->net.create_extractor();
+
+                ex.set_blob_allocator(&workspace.blob_allocator);
+                ex.set_workspace_allocator(&workspace.workspace_allocator);
+
+                ex.input(model->input_name.c_str(), in_tile);
+
+                int ret = ex.extract(model->output_name.c_str(), out_tile[ti]);
+                if (ret != 0)
+                    return ret;
+            }
+
+            stage_done(RealESRGANStageTimes::Inference);
+
+            const int ow = in_w * scale;
+            const int oh = in_h * scale;
+
+            // x, y in the padded output tile
+            auto load_tile = [&](int x, int y, int c) {
+                float v = 0.f;
+                for (int ti = 0; ti < ntta; ti++)
+                {
+                    int tx, ty;
+                    tta_transform(ti, x, y, ow, oh, tx, ty);
+                    v += out_tile[ti].channel(c).row(ty)[tx];
+                }
+
+                return v / (float)ntta;
+            };
+
+            float step_x, step_y, origin_x, origin_y;
+            resize_params(xi, yi, width, height, step_x, step_y, origin_x, origin_y);
+
+            auto load_pixel = [&](int x, int y, int c) {
+                if (!resizing)
+                    return load_tile(x + prepadding * scale, y + prepadding * scale, c);
+
+                // tent filter widened to the downscale ratio
+                const float cx = (float)x * step_x + origin_x;
+                const float cy = (float)y * step_y + origin_y;
+                const float rx = std::max(step_x, 1.f);
+                const float ry = std::max(step_y, 1.f);
+
+                float v = 0.f;
+                float wsum = 0.f;
+                for (int sy = (int)std::ceil(cy - ry); sy <= (int)std::floor(cy + ry); sy++)
+                {
+                    const float wy = 1.f - std::fabs((float)sy - cy) / ry;
+                    for (int sx = (int)std::ceil(cx - rx); sx <= (int)std::floor(cx + rx); sx++)
+                    {
+                        const float w = (1.f - std::fabs((float)sx - cx) / rx) * wy;
+                        v += load_tile(std::clamp(sx, 0, ow - 1), std::clamp(sy, 0, oh - 1), c) * w;
+                        wsum += w;
+                    }
+                }
+
+                return v / wsum;
+            };
+
+            auto load_plane = [&](int x, int y, int c) {
+                if (!yuv)
+                    return load_pixel(x, y, c);
+
+                float rgb[CHANNELS] = {0.f, 0.f, 0.f};
+
+                if (c == 0)
+                {
+                    for (int k = 0; k < CHANNELS; k++)
+                        rgb[k] = load_pixel(x, y, k);
+                }
+                else
+                {
+                    const int lx = x << chroma_ssw;
+                    const int ly = y << chroma_ssh;
+
+                    for (int j = 0; j < (1 << chroma_ssh); j++)
+                    {
+                        for (int k = 0; k < CHANNELS; k++)
+                        {
+                            if (chroma_ssw == 0)
+                                rgb[k] += load_pixel(lx, ly + j, k);
+                            else
+                                rgb[k] += load_pixel(lx - 1, ly + j, k) * 0.25f + load_pixel(lx, ly + j, k) * 0.5f + load_pixel(lx + 1, ly + j, k) * 0.25f;
+                        }
+                    }
+
+                    for (int k = 0; k < CHANNELS; k++)
+                        rgb[k] /= (float)(1 << chroma_ssh);
+                }
+
+                const float Y = kr * rgb[0] + (1.f - kr - kb) * rgb[1] + kb * rgb[2];
+
+                if (c == 0)
+                    return Y;
+                if (c == 1)
+                    return (rgb[2] - Y) / (2.f * (1.f - kb));
+
+                return (rgb[0] - Y) / (2.f * (1.f - kr));
+            };
+
+            // postproc
+            const int out_x0 = out_tile_x(xi, width);
+            const int out_y0 = out_tile_y(yi, height);
+            const int out_tile_w = out_tile_x(xi + 1, width) - out_x0;
+            const int out_tile_h = out_tile_y(yi + 1, height) - out_y0;
+
+            for (int c = 0; c < CHANNELS; c++)
+            {
+                const bool chroma = yuv && c > 0;
+                const int plane_x = chroma ? out_x0 >> chroma_ssw : out_x0;
+                const int plane_y = chroma ? out_y0 >> chroma_ssh : out_y0;
+                const int plane_w = chroma ? out_tile_w >> chroma_ssw : out_tile_w;
+                const int plane_h = chroma ? out_tile_h >> chroma_ssh : out_tile_h;
+                const float sc = chroma ? c_scale : y_scale;
+                const float off = chroma ? c_offset : y_offset;
+
+                for (int y = 0; y < plane_h; y++)
+                {
+                    uint8_t* row = dstp[c] + (size_t)(plane_y + y) * dst_stride[c];
+
+                    for (int x = 0; x < plane_w; x++)
+                        store_sample(row, plane_x + x, type, load_plane(x, y, c) * sc + off, chroma, smax);
+                }
+            }
+
+            stage_done(RealESRGANStageTimes::Postproc);
+        }
+    }
 
     return 0;
 }
@@ -3,18 +3,56 @@
 #ifndef REALESRGAN_H
 #define REALESRGAN_H
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <vector>
 
 // ncnn
 #include "net.h"
 #include "gpu.h"
 #include "layer.h"
 
-class RealESRGAN
+#include "gpuscheduler.h"
+
+// accumulated time of every processing stage in milliseconds. pack and unpack use host timers, the gpu
+// stages vulkan timestamps when ncnn is built with NCNN_BENCHMARK, otherwise they are submitted and
+// waited for one by one
+struct RealESRGANStageTimes
+{
+  enum Stage
+  {
+    Pack,
+    Upload,
+    Preproc,
+    Inference,
+    Postproc,
+    Download,
+    Unpack,
+    StageCount
+  };
+
+  static const char *name(Stage stage);
+
+  void add(Stage stage, double ms);
+
+  double ms[StageCount] = {};
+  std::mutex lock;
+};
+
+// loaded network and shader pipelines, shared by every RealESRGAN using the same model on the same device
+class RealESRGANModel
 {
 public:
-  RealESRGAN(int gpuid, bool tta_mode = false);
-  ~RealESRGAN();
+  RealESRGANModel(int gpuid, bool tta_mode = false);
+  ~RealESRGANModel();
+
+  // network precision, set before load: 0 = fp32, 1 = fp16 storage, 2 = fp16 storage and arithmetic,
+  // 3 = int8 quantized models on the cpu. ncnn turns off what the device does not support when loading
+  void set_precision(int precision);
 
 #if _WIN32
   int load(const std::wstring &parampath, const std::wstring &modelpath);
@@ -22,15 +60,10 @@ public:
   int load(const std::string &parampath, const std::string &modelpath);
 #endif
 
-  int process(const float *srcpR, const float *srcpG, const float *srcpB, float *dstpR, float *dstpG, float *dstpB, int width, int height, int src_stride, int dst_stride) const;
+private:
+  int probe();
 
 public:
-  // realesrgan parameters
-  int scale;
-  int tilesize;
-  int prepadding;
-
-private:
   ncnn::Net net;
   ncnn::Pipeline *realesrgan_preproc;
   ncnn::Pipeline *realesrgan_postproc;
@@ -38,6 +71,138 @@ private:
   ncnn::Layer *bicubic_3x;
   ncnn::Layer *bicubic_4x;
   bool tta_mode;
+  // found by load, the first input and output blobs and the network upscale ratio
+  std::string input_name;
+  std::string output_name;
+  int scale;
+};
+
+class RealESRGAN
+{
+public:
+  explicit RealESRGAN(std::shared_ptr<const RealESRGANModel> model);
+  ~RealESRGAN();
+
+  // srcp/dstp are the R, G, B or Y, U, V planes, strides are in bytes, stage_times is optional. shrunk, also optional,
+  // is set when this call ran out of memory and halved the tiles, see tile_size
+  int process(const uint8_t *const *srcp, uint8_t *const *dstp, int width, int height, const int *src_stride, const int *dst_stride,
+              RealESRGANStageTimes *stage_times = nullptr, bool *shrunk = nullptr) const;
+
+  // tile size of width x height frames, below tilesize x tilesize_y once running out of memory shrank the tiles
+  void tile_size(int width, int height, int &tile_x, int &tile_y) const;
+
+  // frees the tile buffers, allocators and cached tiles kept between frames, the next frame allocates them again
+  // for the tile size in effect then. waits for running process calls
+  void release_buffers() const;
+
+public:
+  // realesrgan parameters
+  int scale;
+  int tilesize;
+  int tilesize_y;
+  int prepadding;
+  // number of tile rows in flight, 1 processes rows serially
+  int pipeline_depth;
+  // sample format of the input and output planes, 8-16 bits integer or 16/32 bits float
+  int bits_per_sample;
+  bool float_sample;
+  // yuv planes with chroma subsampled by 1 << chroma_ssw, 1 << chroma_ssh, converted from/to rgb with
+  // the _Matrix coefficients matrix in limited or full range
+  bool yuv;
+  int chroma_ssw;
+  int chroma_ssh;
+  int matrix;
+  bool full_range;
+  // submission threads running the gpu work of tile rows, shared by every instance on the device,
+  // null runs it on the calling thread one row at a time, so rows only overlap with a scheduler
+  GpuScheduler *scheduler;
+  // tiles whose input samples, halo included, differ from the cached ones by at most this fraction of
+  // full scale reuse the cached network output kept on the gpu, 0 only skips identical tiles, negative
+  // disables. the cache holds the last inferred input of each tile, so above 0 the output depends on the
+  // order concurrent process calls run in. the cpu backend ignores it
+  float skip_threshold;
+  // output frame size, 0 for the input size times scale. other sizes resample the network output in postproc
+  int out_width;
+  int out_height;
+  // 32 bit float output is written by postproc as fp16 and widened on the host, halving the readback at the
+  // cost of fp16 precision. other formats are always downloaded in their own sample type
+  bool half_download;
+  // device memory in MiB the blob allocator blocks behind tile buffers and cached tiles of this instance may hold,
+  // network weights excluded, 0 for no limit. allocations needing a block over it fail like those on an exhausted
+  // device heap
+  int max_vram_mb;
+  // frames that run out of memory are processed again with smaller tiles, kept for later frames, see shrink_tiles.
+  // off, process returns -100 instead
+  bool retry_smaller_tiles;
+
+private:
+  struct TileRow;
+  struct Workspace;
+  struct CachedTile;
+
+  int sample_type() const;
+  int bytes_per_sample() const;
+  int out_sample_type() const;
+  int out_bytes_per_sample() const;
+  float sample_max() const;
+  void sample_range(float &y_scale, float &y_offset, float &c_scale, float &c_offset) const;
+  int tile_size_x(int width) const;
+  int tile_size_y(int height) const;
+  int output_width(int width) const;
+  int output_height(int height) const;
+  int out_tile_x(int xi, int width) const;
+  int out_tile_y(int yi, int height) const;
+  void resize_params(int xi, int yi, int width, int height, float &step_x, float &step_y, float &origin_x, float &origin_y) const;
+  void resize_constants(std::vector<ncnn::vk_constant_type> &constants, int xi, int yi, int width, int height) const;
+  int out_plane_stride(int out_w, int c) const;
+  int out_plane_offset(int out_w, int out_h, int c) const;
+  void format_constants(std::vector<ncnn::vk_constant_type> &constants, bool postproc, int out_w) const;
+
+  void pack_tile_row(const uint8_t *const *srcp, const int *src_stride, int in_tile_y0, ncnn::VkMat &in) const;
+  void unpack_tile_row(const ncnn::VkMat &out, uint8_t *const *dstp, const int *dst_stride, int out_w, int out_h, int out_tile_y0) const;
+
+  Workspace *acquire_workspace() const;
+  void release_workspace(Workspace *workspace) const;
+  void free_workspace(Workspace *workspace) const;
+  void free_buffers() const;
+  int shrink_tiles(int width, int height, int tile_x, int tile_y) const;
+
+  void gather_tile(const uint8_t *const *srcp, const int *src_stride, int width, int height, int x0, int x1, int y0, int y1,
+                   std::vector<uint8_t> &samples) const;
+  bool same_tile(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) const;
+  void lookup_tiles(TileRow &row, const uint8_t *const *srcp, const int *src_stride, int width, int height) const;
+  void store_tiles(TileRow &row, int width, int height) const;
+
+  int process_tile_row(TileRow &row, int width, int height, RealESRGANStageTimes *stage_times) const;
+
+  int process_gpu(Workspace &workspace, const uint8_t *const *srcp, uint8_t *const *dstp, int width, int height, const int *src_stride,
+                  const int *dst_stride, RealESRGANStageTimes *stage_times) const;
+  int process_cpu(Workspace &workspace, const uint8_t *const *srcp, uint8_t *const *dstp, int width, int height, const int *src_stride, const int *dst_stride,
+                  RealESRGANStageTimes *stage_times) const;
+
+private:
+  std::shared_ptr<const RealESRGANModel> model;
+
+  // tile size limits set when the device runs out of memory, kept for later frames. process calls hold
+  // shrink_lock shared, shrinking the tiles holds it exclusively
+  mutable std::shared_mutex shrink_lock;
+  mutable int tile_limit_x;
+  mutable int tile_limit_y;
+
+  // bytes of allocator blocks reserved against max_vram_mb
+  mutable std::atomic<size_t> vram_used;
+
+  // buffers and allocators of finished process calls, reused by the next frame. with a scheduler there are at most
+  // as many as it runs and queues tile rows, further calls wait for a free one
+  mutable std::mutex workspace_lock;
+  mutable std::condition_variable workspace_freed;
+  mutable std::vector<Workspace *> workspaces;
+  mutable std::vector<Workspace *> free_workspaces;
+
+  // network output of the last inferred input of every tile, see skip_threshold
+  mutable std::mutex tile_cache_lock;
+  mutable std::unique_ptr<ncnn::VkAllocator> tile_cache_allocator;
+  mutable std::vector<CachedTile> tile_cache;
 };
 
 #endif // REALESRGAN_H